@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+
+
+namespace Kernels
+{
+    // Entry points of one ISA variant of the kernels (see KernelsImpl.h); the variant is picked once, at startup
+    struct KernelTable
+    {
+        const char* name;
+
+        size_t (*horrorOutputLength)(const char* input, size_t length);
+        void (*horrorTransform)(const char* input, size_t length, char* output);
+        void (*comedyTransform)(const char* input, size_t length, char* output);
+        void (*fantasyTransform)(const char* input, size_t length, char* output);
+        void (*sfTransform)(const char* input, size_t length, char* output);
+
+        size_t (*findDoubleNewLine)(const char* data, size_t pos, size_t size);
+    };
+
+    // baseline x86-64 (SSE2)
+    namespace Baseline { extern const KernelTable TABLE; }
+    // AVX2, POPCNT, BMI1/2
+    namespace AVX2 { extern const KernelTable TABLE; }
+    // AVX-512 F/BW on top of the AVX2 set
+    namespace AVX512 { extern const KernelTable TABLE; }
+
+    // Whether the CPU can run the given variant (the baseline one always can)
+    bool IsSupported(const KernelTable& table);
+}
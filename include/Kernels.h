@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+
+
+// Genre transforms, applied to a range of whole lines (every line terminated by '\n', which is copied as is)
+// The output length is known before anything is written (GetOutputLength), so the caller can place the output of every
+// range at its final position in advance; Transform writes exactly that many bytes
+// IN_PLACE kernels may be given the same buffer as input and output
+// Every kernel is built for several ISAs (baseline x86-64, AVX2, AVX-512), the best one the CPU supports is picked at
+// the first call (see Kernels.cpp)
+namespace Kernels
+{
+    // Every consonant is doubled, the copy is lowercase
+    struct Horror
+    {
+        static const bool IN_PLACE = false;
+
+        static size_t GetOutputLength(const char* input, size_t length);
+        static void Transform(const char* input, size_t length, char* output);
+    };
+
+    // Every letter found on an even position (counting from 1) of its word is uppercased
+    struct Comedy
+    {
+        static const bool IN_PLACE = true;
+
+        static size_t GetOutputLength(const char* input, size_t length) { (void)input; return length; }
+        static void Transform(const char* input, size_t length, char* output);
+    };
+
+    // The first letter of every word is uppercased
+    struct Fantasy
+    {
+        static const bool IN_PLACE = true;
+
+        static size_t GetOutputLength(const char* input, size_t length) { (void)input; return length; }
+        static void Transform(const char* input, size_t length, char* output);
+    };
+
+    // Every 7th word of each line is reversed
+    // Words are the maximal runs of non-space bytes: consecutive (or leading / trailing) spaces don't delimit extra words
+    struct SF
+    {
+        static const bool IN_PLACE = true;
+
+        static size_t GetOutputLength(const char* input, size_t length) { (void)input; return length; }
+        static void Transform(const char* input, size_t length, char* output);
+    };
+
+    // Returns the position of the first "\n\n" pair found at or after `pos` (or `size` if there is none)
+    size_t FindDoubleNewLine(const char* data, size_t pos, size_t size);
+
+    // Name of the ISA variant in use: "baseline", "avx2" or "avx512"
+    const char* GetTargetName();
+}
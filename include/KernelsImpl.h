@@ -0,0 +1,575 @@
+#pragma once
+
+// Implementation of the kernels, compiled once for every ISA variant: only the Kernels*.cpp variant translation units
+// include this file, after defining KERNELS_TARGET (the name of the variant's namespace, see KernelTable.h)
+// The code picks its vector paths from the ISA macros (__AVX512BW__, __AVX2__, ...) of the translation unit
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__SSSE3__) || defined(__SSE2__)
+    #include <immintrin.h>
+#endif
+
+#include "KernelTable.h"
+#include "Utils.h"
+
+#if !defined(KERNELS_TARGET) || !defined(KERNELS_TARGET_NAME)
+    #error "KERNELS_TARGET and KERNELS_TARGET_NAME must be defined before including KernelsImpl.h"
+#endif
+
+
+namespace
+{
+    // Every variant is built with different ISA flags, so nothing here may call an inline function or a template with
+    // external linkage: the linker keeps a single copy of those, possibly the AVX-512 one, for every variant
+    // The character table is plain data and is safe to share
+    inline const Utils::CharTraits& GetTraits(char ch)
+    {
+        return Utils::CharTable::entries[static_cast<unsigned char>(ch)];
+    }
+
+    inline void ReverseBytes(char* first, char* last)
+    {
+        while (last - first > 1) {
+            --last;
+            char ch = *first;
+            *first = *last;
+            *last = ch;
+            ++first;
+        }
+    }
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+    // Lookup tables of the vectorized Horror kernel
+    struct HorrorTables
+    {
+        // a byte is a consonant if consonantBits[low nibble] has the bit (1 << high nibble) set (only ASCII letters qualify)
+        alignas(16) uint8_t consonantBits[16];
+        alignas(16) uint8_t highNibbleBit[16];
+
+        // pshufb controls that expand 8 bytes, each consonant followed by its lowercase copy, for every consonant mask
+        // the source register holds the 8 input bytes (indices 0..7) followed by the same bytes lowercased (8..15)
+        alignas(16) uint8_t expand[256][16];
+
+        HorrorTables()
+        {
+            memset(this, 0, sizeof(*this));
+
+            for (int ch = 0; ch != 128; ++ch) {
+                if (GetTraits(static_cast<char>(ch)).isConsonant) {
+                    consonantBits[ch & 0x0F] |= 1 << (ch >> 4);
+                }
+            }
+            for (int nibble = 0; nibble != 8; ++nibble) {
+                highNibbleBit[nibble] = 1 << nibble;
+            }
+
+            for (int mask = 0; mask != 256; ++mask) {
+                int pos = 0;
+
+                for (int i = 0; i != 8; ++i) {
+                    expand[mask][pos++] = i;
+                    if (mask & (1 << i)) {
+                        expand[mask][pos++] = 8 + i;
+                    }
+                }
+                while (pos != 16) {
+                    expand[mask][pos++] = 0x80;
+                }
+            }
+        }
+    };
+
+    const HorrorTables& GetHorrorTables()
+    {
+        static const HorrorTables tables;
+        return tables;
+    }
+
+    // Returns one bit per byte, set for the consonants
+    inline unsigned int ClassifyConsonants(__m128i bytes, const HorrorTables& tables)
+    {
+        const __m128i lowNibbles = _mm_set1_epi8(0x0F);
+        __m128i consonantBits = _mm_load_si128(reinterpret_cast<const __m128i*>(tables.consonantBits));
+        __m128i highNibbleBit = _mm_load_si128(reinterpret_cast<const __m128i*>(tables.highNibbleBit));
+
+        __m128i low = _mm_shuffle_epi8(consonantBits, _mm_and_si128(bytes, lowNibbles));
+        __m128i high = _mm_shuffle_epi8(highNibbleBit, _mm_and_si128(_mm_srli_epi16(bytes, 4), lowNibbles));
+        __m128i notConsonant = _mm_cmpeq_epi8(_mm_and_si128(low, high), _mm_setzero_si128());
+
+        return ~_mm_movemask_epi8(notConsonant) & 0xFFFF;
+    }
+
+#if defined(__AVX2__)
+    inline unsigned int ClassifyConsonants(__m256i bytes, const HorrorTables& tables)
+    {
+        const __m256i lowNibbles = _mm256_set1_epi8(0x0F);
+        __m256i consonantBits = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(tables.consonantBits)));
+        __m256i highNibbleBit = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(tables.highNibbleBit)));
+
+        __m256i low = _mm256_shuffle_epi8(consonantBits, _mm256_and_si256(bytes, lowNibbles));
+        __m256i high = _mm256_shuffle_epi8(highNibbleBit, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), lowNibbles));
+        __m256i notConsonant = _mm256_cmpeq_epi8(_mm256_and_si256(low, high), _mm256_setzero_si256());
+
+        return ~static_cast<unsigned int>(_mm256_movemask_epi8(notConsonant));
+    }
+#endif
+
+    // Expands 16 input bytes (consonant mask `mask`) into 16 + popcount(mask) output bytes; always stores 2 x 16 bytes
+    inline char* ExpandConsonants(__m128i bytes, unsigned int mask, char* output, const HorrorTables& tables)
+    {
+        __m128i lowered = _mm_or_si128(bytes, _mm_set1_epi8(0x20));
+        __m128i low = _mm_unpacklo_epi64(bytes, lowered);
+        __m128i high = _mm_unpackhi_epi64(bytes, lowered);
+
+        __m128i lowControl = _mm_load_si128(reinterpret_cast<const __m128i*>(tables.expand[mask & 0xFF]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(output), _mm_shuffle_epi8(low, lowControl));
+        output += 8 + __builtin_popcount(mask & 0xFF);
+
+        __m128i highControl = _mm_load_si128(reinterpret_cast<const __m128i*>(tables.expand[(mask >> 8) & 0xFF]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(output), _mm_shuffle_epi8(high, highControl));
+        output += 8 + __builtin_popcount((mask >> 8) & 0xFF);
+
+        return output;
+    }
+#endif
+
+#if defined(__AVX512BW__)
+    // 64 byte block of text, one bit per byte in every mask
+    struct TextBlock
+    {
+        __m512i bytes;
+    };
+
+    inline TextBlock LoadBlock(const char* input)
+    {
+        return TextBlock{ _mm512_loadu_si512(input) };
+    }
+
+    inline uint64_t SeparatorMask(const TextBlock& block)
+    {
+        return _mm512_cmpeq_epi8_mask(block.bytes, _mm512_set1_epi8(' ')) | _mm512_cmpeq_epi8_mask(block.bytes, _mm512_set1_epi8('\n'));
+    }
+
+    inline uint64_t NewLineMask(const TextBlock& block)
+    {
+        return _mm512_cmpeq_epi8_mask(block.bytes, _mm512_set1_epi8('\n'));
+    }
+
+    inline uint64_t LowercaseMask(const TextBlock& block)
+    {
+        return _mm512_cmplt_epu8_mask(_mm512_sub_epi8(block.bytes, _mm512_set1_epi8('a')), _mm512_set1_epi8(26));
+    }
+
+    // Uppercases the (lowercase) bytes selected by `mask` and stores the whole block
+    inline void StoreUppercased(const TextBlock& block, uint64_t mask, char* output)
+    {
+        _mm512_storeu_si512(output, _mm512_mask_sub_epi8(block.bytes, mask, block.bytes, _mm512_set1_epi8(0x20)));
+    }
+#elif defined(__AVX2__)
+    // 64 byte block of text, one bit per byte in every mask
+    struct TextBlock
+    {
+        __m256i lo;
+        __m256i hi;
+    };
+
+    inline TextBlock LoadBlock(const char* input)
+    {
+        return TextBlock{ _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input)), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + 32)) };
+    }
+
+    // Bit i of the result is set if byte i of the 64 byte block (lo, hi) matched
+    inline uint64_t ToBitMask(__m256i lo, __m256i hi)
+    {
+        return static_cast<uint32_t>(_mm256_movemask_epi8(lo)) | (static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(hi))) << 32);
+    }
+
+    inline __m256i SeparatorBytes(__m256i bytes)
+    {
+        return _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n')));
+    }
+
+    inline __m256i LowercaseBytes(__m256i bytes)
+    {
+        // 'a'..'z' are the only bytes that fall into [0, 25] once 'a' is subtracted (unsigned compare)
+        __m256i offset = _mm256_sub_epi8(bytes, _mm256_set1_epi8('a'));
+        return _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(25)), offset);
+    }
+
+    inline uint64_t SeparatorMask(const TextBlock& block)
+    {
+        return ToBitMask(SeparatorBytes(block.lo), SeparatorBytes(block.hi));
+    }
+
+    inline uint64_t NewLineMask(const TextBlock& block)
+    {
+        const __m256i newLine = _mm256_set1_epi8('\n');
+        return ToBitMask(_mm256_cmpeq_epi8(block.lo, newLine), _mm256_cmpeq_epi8(block.hi, newLine));
+    }
+
+    inline uint64_t LowercaseMask(const TextBlock& block)
+    {
+        return ToBitMask(LowercaseBytes(block.lo), LowercaseBytes(block.hi));
+    }
+
+    // Inverse of movemask: 0xFF for every set bit of `mask`, 0x00 otherwise
+    inline __m256i FromBitMask(uint32_t mask)
+    {
+        const __m256i byteIdx = _mm256_setr_epi64x(0x0000000000000000, 0x0101010101010101, 0x0202020202020202, 0x0303030303030303);
+        const __m256i bitInByte = _mm256_set1_epi64x(0x7FBFDFEFF7FBFDFE);
+
+        __m256i bytes = _mm256_shuffle_epi8(_mm256_set1_epi32(mask), byteIdx);
+        return _mm256_cmpeq_epi8(_mm256_or_si256(bytes, bitInByte), _mm256_set1_epi8(-1));
+    }
+
+    // Uppercases the (lowercase) bytes selected by `mask` and stores the whole block
+    inline void StoreUppercased(const TextBlock& block, uint64_t mask, char* output)
+    {
+        const __m256i caseBit = _mm256_set1_epi8(0x20);
+
+        __m256i lo = _mm256_xor_si256(block.lo, _mm256_and_si256(FromBitMask(static_cast<uint32_t>(mask)), caseBit));
+        __m256i hi = _mm256_xor_si256(block.hi, _mm256_and_si256(FromBitMask(static_cast<uint32_t>(mask >> 32)), caseBit));
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(output), lo);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(output + 32), hi);
+    }
+#endif
+    // Consonants are classified 16/32 bytes at a time with a nibble lookup table (pshufb), the rest is scalar
+    size_t HorrorOutputLength(const char* input, size_t length)
+    {
+        size_t outputLength = length;
+        size_t i = 0;
+
+#if defined(__AVX2__)
+        const HorrorTables& tables = GetHorrorTables();
+
+        for (; i + 32 <= length; i += 32) {
+            __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + i));
+            outputLength += __builtin_popcount(ClassifyConsonants(bytes, tables));
+        }
+#elif defined(__SSSE3__)
+        const HorrorTables& tables = GetHorrorTables();
+
+        for (; i + 16 <= length; i += 16) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+            outputLength += __builtin_popcount(ClassifyConsonants(bytes, tables));
+        }
+#endif
+
+        for (; i != length; ++i) {
+            outputLength += GetTraits(input[i]).isConsonant;
+        }
+
+        return outputLength;
+    }
+
+    // Every 8 input bytes are expanded with one shuffle, picked by their consonant mask; the output position advances by
+    // 8 + popcount(mask). The stores are 16 bytes wide: the output is never shorter than the input left to process, so
+    // the vector loop stops while there are still at least 32 input bytes left and the tail is done byte by byte
+    void HorrorTransform(const char* input, size_t length, char* output)
+    {
+        size_t i = 0;
+
+#if defined(__AVX2__)
+        const HorrorTables& tables = GetHorrorTables();
+
+        for (; i + 64 <= length; i += 32) {
+            __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + i));
+            unsigned int mask = ClassifyConsonants(bytes, tables);
+
+            output = ExpandConsonants(_mm256_castsi256_si128(bytes), mask & 0xFFFF, output, tables);
+            output = ExpandConsonants(_mm256_extracti128_si256(bytes, 1), mask >> 16, output, tables);
+        }
+#elif defined(__SSSE3__)
+        const HorrorTables& tables = GetHorrorTables();
+
+        for (; i + 32 <= length; i += 16) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+            output = ExpandConsonants(bytes, ClassifyConsonants(bytes, tables), output, tables);
+        }
+#endif
+
+        for (; i != length; ++i) {
+            char ch = input[i];
+
+            *output++ = ch;
+            if (GetTraits(ch).isConsonant) {
+                *output++ = GetTraits(ch).lower;
+            }
+        }
+    }
+
+    // A new line starts a new word, just like a space does
+    // A letter is on an even position of its word if it has the same parity as the last separator before it. The vector
+    // loop finds, for 64 bytes at once, the letters that follow an odd separator: adding the "right after an odd
+    // separator" bits to the non-separator mask carries through every such word and flips exactly its bits
+    // Works in place (output == input)
+    void ComedyTransform(const char* input, size_t length, char* output)
+    {
+        size_t i = 0;
+        int idx = 1;
+
+#if defined(__AVX2__)
+        const uint64_t oddPositions = 0xAAAAAAAAAAAAAAAAull;
+
+        // the chunk starts right after a virtual separator at position -1, which is odd
+        uint64_t lastSeparatorOdd = 1;
+
+        for (; i + 64 <= length; i += 64) {
+            TextBlock block = LoadBlock(input + i);
+
+            uint64_t separators = SeparatorMask(block);
+            uint64_t lowercase = LowercaseMask(block);
+            uint64_t wordBytes = ~separators;
+
+            uint64_t oddWordStarts = ((separators & oddPositions) << 1) | lastSeparatorOdd;
+            uint64_t afterOddSeparator = (wordBytes + oddWordStarts) ^ wordBytes;
+            uint64_t evenInWord = (afterOddSeparator & oddPositions) | (~afterOddSeparator & ~oddPositions);
+
+            StoreUppercased(block, evenInWord & lowercase, output + i);
+
+            if (separators) {
+                lastSeparatorOdd = (63 - __builtin_clzll(separators)) & 1;
+            }
+        }
+
+        // only the parity of the position in the word matters: the block ended on an even position
+        idx = static_cast<int>(lastSeparatorOdd);
+#endif
+
+        for (; i != length; ++i) {
+            char ch = input[i];
+
+            if (ch == ' ' || ch == '\n') {
+                idx = 0;
+            }
+            else if (idx % 2 == 0) {
+                // non-letters map to themselves
+                ch = GetTraits(ch).upper;
+            }
+
+            output[i] = ch;
+            idx++;
+        }
+    }
+
+    // The vector loop selects the lowercase bytes that follow a separator (the separator mask shifted by one position)
+    // Works in place (output == input)
+    void FantasyTransform(const char* input, size_t length, char* output)
+    {
+        size_t i = 0;
+        bool upperNext = true;
+
+#if defined(__AVX2__)
+        // the chunk starts a new word; afterwards, whether the previous block ended with a separator
+        uint64_t previousSeparator = 1;
+
+        for (; i + 64 <= length; i += 64) {
+            TextBlock block = LoadBlock(input + i);
+
+            uint64_t separators = SeparatorMask(block);
+            uint64_t lowercase = LowercaseMask(block);
+            uint64_t wordStarts = (separators << 1) | previousSeparator;
+
+            StoreUppercased(block, wordStarts & lowercase, output + i);
+
+            previousSeparator = separators >> 63;
+        }
+
+        upperNext = (previousSeparator != 0);
+#endif
+
+        for (; i != length; ++i) {
+            char ch = input[i];
+
+            if (ch == ' ' || ch == '\n') {
+                upperNext = true;
+            }
+            else if (upperNext) {
+                upperNext = false;
+                ch = GetTraits(ch).upper;
+            }
+
+            output[i] = ch;
+        }
+    }
+
+    // Works in place (output == input): the text is copied only when the buffers differ, then every 7th word is
+    // reversed inside the output buffer. Word starts are counted 64 bytes at a time (separator masks and popcount),
+    // only the blocks where a 7th word starts or ends are looked at bit by bit
+    void SFTransform(const char* input, size_t length, char* output)
+    {
+        if (output != input) {
+            memcpy(output, input, length);
+        }
+
+        size_t i = 0;
+        int wordIdx = 0;            // index (modulo 7) of the next word of the current line
+        bool inWord = false;
+        bool reversing = false;     // inside a 7th word, which started at `reverseStart`
+        size_t reverseStart = 0;
+
+#if defined(__AVX2__)
+        // the chunk starts on a new line; afterwards, whether the previous block ended with a separator
+        uint64_t previousSeparator = 1;
+
+        for (; i + 64 <= length; i += 64) {
+            TextBlock block = LoadBlock(output + i);
+
+            uint64_t separators = SeparatorMask(block);
+            uint64_t newLines = NewLineMask(block);
+            uint64_t afterSeparator = (separators << 1) | previousSeparator;
+            uint64_t wordStarts = ~separators & afterSeparator;
+            uint64_t wordEnds = separators & ~afterSeparator;
+
+            previousSeparator = separators >> 63;
+
+            if (reversing) {
+                if (!wordEnds) {
+                    // the whole block is part of the word
+                    continue;
+                }
+                ReverseBytes(output + reverseStart, output + i + __builtin_ctzll(wordEnds));
+                reversing = false;
+            }
+
+            // every line has its own word count: the word starts are counted line by line
+            for (;;) {
+                uint64_t lineStarts = wordStarts;
+                if (newLines) {
+                    lineStarts &= (newLines & -newLines) - 1;
+                }
+
+                int numStarts = __builtin_popcountll(lineStarts);
+                while (wordIdx + numStarts >= 7) {
+                    // skip to the 7th word
+                    for (int skip = wordIdx; skip != 6; ++skip) {
+                        lineStarts &= lineStarts - 1;
+                    }
+                    numStarts -= 7 - wordIdx;
+                    wordIdx = 0;
+
+                    int startBit = __builtin_ctzll(lineStarts);
+                    uint64_t laterEnds = wordEnds & ~((2ull << startBit) - 1);
+                    if (laterEnds) {
+                        ReverseBytes(output + i + startBit, output + i + __builtin_ctzll(laterEnds));
+                    }
+                    else {
+                        reversing = true;
+                        reverseStart = i + startBit;
+                    }
+                    lineStarts &= lineStarts - 1;
+                }
+                wordIdx += numStarts;
+
+                if (!newLines) {
+                    break;
+                }
+                wordStarts &= ~((newLines & -newLines) - 1);
+                newLines &= newLines - 1;
+                wordIdx = 0;
+            }
+        }
+
+        inWord = !previousSeparator;
+#endif
+
+        for (; i != length; ++i) {
+            char ch = output[i];
+
+            if (ch == ' ' || ch == '\n') {
+                if (reversing) {
+                    ReverseBytes(output + reverseStart, output + i);
+                    reversing = false;
+                }
+                if (ch == '\n') {
+                    wordIdx = 0;
+                }
+                inWord = false;
+            }
+            else if (!inWord) {
+                inWord = true;
+                if (wordIdx == 6) {
+                    reversing = true;
+                    reverseStart = i;
+                }
+                wordIdx = (wordIdx + 1) % 7;
+            }
+        }
+
+        if (reversing) {
+            ReverseBytes(output + reverseStart, output + length);
+        }
+    }
+
+    // Returns the position of the first "\n\n" pair found at or after `pos` (or `size` if there is none)
+    size_t FindDoubleNewLine(const char* data, size_t pos, size_t size)
+    {
+        // compare every byte and its successor at once; both loads must stay inside the buffer
+#if defined(__AVX512BW__)
+        const __m512i newLines = _mm512_set1_epi8('\n');
+
+        for (; pos + 64 < size; pos += 64) {
+            __m512i current = _mm512_loadu_si512(data + pos);
+            __m512i next = _mm512_loadu_si512(data + pos + 1);
+            uint64_t mask = _mm512_cmpeq_epi8_mask(current, newLines) & _mm512_cmpeq_epi8_mask(next, newLines);
+
+            if (mask) {
+                return pos + __builtin_ctzll(mask);
+            }
+        }
+#elif defined(__AVX2__)
+        const __m256i newLines = _mm256_set1_epi8('\n');
+
+        for (; pos + 32 < size; pos += 32) {
+            __m256i current = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+            __m256i next = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos + 1));
+            __m256i pairs = _mm256_and_si256(_mm256_cmpeq_epi8(current, newLines), _mm256_cmpeq_epi8(next, newLines));
+
+            unsigned int mask = _mm256_movemask_epi8(pairs);
+            if (mask) {
+                return pos + __builtin_ctz(mask);
+            }
+        }
+#elif defined(__SSE2__)
+        const __m128i newLines = _mm_set1_epi8('\n');
+
+        for (; pos + 16 < size; pos += 16) {
+            __m128i current = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+            __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos + 1));
+            __m128i pairs = _mm_and_si128(_mm_cmpeq_epi8(current, newLines), _mm_cmpeq_epi8(next, newLines));
+
+            unsigned int mask = _mm_movemask_epi8(pairs);
+            if (mask) {
+                return pos + __builtin_ctz(mask);
+            }
+        }
+#endif
+
+        for (; pos + 1 < size; ++pos) {
+            if (data[pos] == '\n' && data[pos + 1] == '\n') {
+                return pos;
+            }
+        }
+        return size;
+    }
+}
+
+
+namespace Kernels
+{
+    namespace KERNELS_TARGET
+    {
+        extern const KernelTable TABLE = {
+            KERNELS_TARGET_NAME,
+            HorrorOutputLength,
+            HorrorTransform,
+            ComedyTransform,
+            FantasyTransform,
+            SFTransform,
+            FindDoubleNewLine
+        };
+    }
+}
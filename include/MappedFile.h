@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <ctime>
+
+
+// Memory mapping of a whole file: read-only (Open) or created with a known size and writable (Create)
+// The mapped bytes are backed by the page cache, so slices of it can be handed directly to MPI without copying them
+
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    bool Open(const std::string& fileName);
+    bool Create(const std::string& fileName, size_t size);
+    void Close();
+
+    const char* GetData() const { return _data; }
+    char* GetWritableData() { return _writable ? _data : nullptr; }
+    size_t GetSize() const { return _size; }
+    const struct timespec& GetModificationTime() const { return _modificationTime; }
+
+private:
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+
+    int _fd;
+    char* _data;
+    size_t _size;
+    bool _writable;
+    struct timespec _modificationTime;
+};
@@ -1,13 +1,40 @@
 #pragma once
 
-#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <string>
 #include <vector>
 
+#include "MappedFile.h"
 #include "Nodes.h"
+#include "OutputWriter.h"
+#include "ParallelOutputFile.h"
+#include "ParagraphScanner.h"
+#include "Protocol.h"
 
 #define MASTER_NUM_THREADS 4
 
+// Build with -DMASTER_EVENT_DRIVEN_RECEIVE to collect the results of all workers on the Master's main thread
+// (MPI_Irecv + MPI_Waitsome) instead of using one blocked receive thread per worker
+
+// Build with -DCOMM_FUNNELED to make every MPI call from the Master's main thread (only MPI_THREAD_FUNNELED is needed)
+// The sender threads hand their envelopes over to a SendQueue; implies the event-driven receive above
+#ifdef COMM_FUNNELED
+    #ifndef MASTER_EVENT_DRIVEN_RECEIVE
+        #define MASTER_EVENT_DRIVEN_RECEIVE
+    #endif
+#endif
+
+// Build with -DOUTPUT_MPI_IO to take the Master off the output data path: the workers only report the size of every
+// processed paragraph, the Master computes the file offsets (prefix sum) and every rank writes its own paragraphs
+// into the shared output file with MPI-IO. The workers keep all their results until the offsets are known
+
+// Build with -DOUTPUT_MMAP to assemble the output file in place: the workers report the sizes first, then the Master
+// sizes and maps the output file and the receive threads get every paragraph text straight into its final position
+
+// How long the funneled main thread sleeps when there is nothing to send and nothing was received
+#define MASTER_POLL_INTERVAL_US (50)
+
 class Master : public Node
 {
 public:
@@ -18,20 +45,50 @@ public:
 
 private:
     void WorkerThread(int workerNode);
-    void ParseAndSendToWorkerNode(int workerNode, const std::string& paragraphName);
+    void SendToWorkerNode(int workerNode, const std::string& paragraphName);
     void ReceiveAndReassembleFromWorkerNode(int workerNode, const std::string& paragraphName);
+    void ReceiveAndReassembleFromAllWorkerNodes();
+    bool ReassembleEnvelope(int workerNode, Protocol::EnvelopeReader& reader);
 
-    void WriteOutputFile();
-
+#ifdef PROTOCOL_SIZE_FRAMES
+    int64_t ComputeOutputLayout();
+#endif
+#ifdef OUTPUT_MPI_IO
+    void WriteOutputFileParallel();
+#endif
+#ifdef OUTPUT_MMAP
+    void WaitForOutputFile();
+    void CreateOutputFile();
+    void PostPayloadReceives(int workerNode, std::vector<MPI_Request>& requests);
+#endif
 
-    struct Paragraph
-    {
-        int paragraphType;
-        std::string fullParagraph;
-    };
 
     std::string _inFileName;
     std::string _outFileName;
-    std::atomic<bool> _paragraphsListInitialized;
-    std::vector<Master::Paragraph> _paragraphsList;
+    std::string _indexFileName;     // <input>.idx: the extension is kept, so no input can collide with its own index
+    MappedFile _inFile;
+    std::vector<ParagraphInfo> _inputParagraphs;
+#ifdef PROTOCOL_SIZE_FRAMES
+    std::vector<int64_t> _outputSizes;      // processed text only, header excluded
+    std::vector<int64_t> _outputOffsets;    // start of the header
+    std::string _paragraphHeaders[Node::NUM_NODE_TYPES];
+#endif
+#if defined(OUTPUT_MPI_IO)
+    ParallelOutputFile _outputFile;
+#elif defined(OUTPUT_MMAP)
+    MappedFile _outputFile;
+    std::mutex _outputMutex;
+    std::condition_variable _outputCondVar;
+    int _numSizedWorkers;
+    bool _outputFileCreated;
+#else
+    OutputWriter _outputWriter;
+#endif
+
+    // flow control windows granted by the workers (indexed by rank - RANK_WORKER_HORROR)
+    Protocol::CreditGate _credits[MASTER_NUM_THREADS];
+
+#ifdef COMM_FUNNELED
+    Protocol::SendQueue _sendQueue;
+#endif
 };
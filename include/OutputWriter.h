@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ParagraphScanner.h"
+
+// Number of paragraphs (counted from the next one to be written) that may be in flight at the same time
+// The Master doesn't send a paragraph outside of this window, so at most this many results wait to be written
+// Their size is bounded by the worker credits: those are only given back once a paragraph is written (see Start)
+#define OUTPUT_REORDER_WINDOW (8192)
+
+
+// Appends the processed paragraphs to the output file in global ID order, as soon as the next expected one is complete
+// Results that arrive out of order wait in a ring of OUTPUT_REORDER_WINDOW slots; the file is written by its own thread
+// Paragraphs with unknown headers are never sent to a worker, they are written as empty "master" paragraphs
+class OutputWriter
+{
+public:
+    OutputWriter(size_t windowSize = OUTPUT_REORDER_WINDOW);
+    ~OutputWriter();
+
+    // `onWritten` is called on the writer thread for every worker paragraph, once it's in the file and its text is freed
+    void Start(const std::string& fileName, const std::vector<ParagraphInfo>& paragraphs, std::function<void(int)> onWritten);
+
+    // Waits for all the paragraphs to be written
+    void Finish();
+
+    // Sender side: a paragraph may only be sent once its slot is inside the window
+    bool IsInWindow(int paragraphId) const;
+    void WaitForWindow(int paragraphId);
+
+    // Receiver side: fragments of the same paragraph must arrive in order, `last` completes the paragraph
+    void AppendResult(int paragraphId, const char* payload, int length, bool last);
+
+private:
+    void WriterThread();
+
+
+    struct Slot
+    {
+        std::string text;
+        bool complete;
+    };
+
+    std::ofstream _outFile;
+    const std::vector<ParagraphInfo>* _paragraphs;
+    std::function<void(int)> _onWritten;
+    std::thread _thread;
+
+    // a slot is only touched by the receiver of its paragraph until it's complete, then only by the writer thread
+    std::vector<Slot> _slots;
+    std::atomic<int> _nextParagraphId;
+    std::mutex _mutex;
+    std::condition_variable _completedCondVar;
+    std::condition_variable _writtenCondVar;
+};
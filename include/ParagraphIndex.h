@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "MappedFile.h"
+#include "ParagraphScanner.h"
+
+
+// Binary sidecar that caches the scanner's output for an input file, so repeated runs over the same input skip parsing
+//
+// Layout: header, then one (offset, length) pair of uint64 per paragraph, then one uint8 paragraph type per paragraph
+// The index is only trusted if the input file still has the same size and mtime and the hash matches. The hash covers
+// the index entries plus the first and last bytes of the input; hashing the whole input would cost as much as a scan.
+
+namespace ParagraphIndex
+{
+    bool Load(const std::string& indexFileName, const MappedFile& inFile, std::vector<ParagraphInfo>& paragraphs);
+    bool Save(const std::string& indexFileName, const MappedFile& inFile, const std::vector<ParagraphInfo>& paragraphs);
+}
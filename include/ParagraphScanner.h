@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "Nodes.h"
+
+// Smallest byte range worth scanning on its own thread
+#define SCANNER_MIN_CHUNK_SIZE (4 * 1024 * 1024)
+
+
+// Describes one paragraph of the input file. The position in the scanner's output vector is the global paragraph ID
+struct ParagraphInfo
+{
+    int paragraphType;      // worker rank that handles the paragraph, RANK_MASTER if the header matches no worker
+    size_t offset;          // paragraph body (header excluded) as a byte range of the input file
+    size_t length;          // the body contains whole lines, each terminated by '\n' (except, maybe, the last line of the file)
+};
+
+// Splits the (memory mapped) input file into paragraphs in a single pass
+// Paragraph boundaries are found with a vectorized "\n\n" search (Kernels::FindDoubleNewLine), only header lines are inspected
+// Large files are split into byte ranges which are scanned in parallel, one thread per range
+// The IDs (indices) are the same ones that every Master thread used to compute while parsing the file on its own
+class ParagraphScanner
+{
+public:
+    ParagraphScanner(const char* data, size_t size);
+
+    void Scan(std::vector<ParagraphInfo>& paragraphs, unsigned int numThreads = 0);
+
+    int GetParagraphTypeFromHeader(const char* header, size_t length) const;
+
+private:
+    void ScanChunk(size_t start, size_t end, bool insideParagraph, std::vector<ParagraphInfo>& paragraphs) const;
+    size_t FindChunkStart(size_t pos) const;
+    size_t FindLineEnd(size_t pos) const;
+    size_t FindEmptyLine(size_t pos) const;
+
+
+    const char* _data;
+    size_t _size;
+    std::string _paragraphNames[Node::NUM_NODE_TYPES];
+};
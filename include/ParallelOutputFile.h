@@ -0,0 +1,40 @@
+#pragma once
+
+#include <mpi.h>
+#include <string>
+#include <vector>
+
+
+// Piece of the output file written by one rank: `length` bytes from `data` go to the absolute file offset `offset`
+struct OutputBlock
+{
+    MPI_Offset offset;
+    const char* data;
+    int length;
+};
+
+// Output file shared by all the ranks through MPI-IO; every rank writes its own paragraphs at precomputed offsets
+// All the methods are collective over MPI_COMM_WORLD, so every rank must call them in the same order
+class ParallelOutputFile
+{
+public:
+    ParallelOutputFile();
+    ~ParallelOutputFile();
+
+    // The Master passes the file name, the workers receive it (their `fileName` is ignored)
+    // The file is truncated: whatever an older run left in it is gone
+    void Open(const std::string& fileName);
+    void Close();
+
+    // Writes all the blocks of this rank with a single MPI_File_write_all
+    // The blocks must be sorted by offset and must not overlap, neither with each other nor with other ranks' blocks
+    void WriteBlocks(const std::vector<OutputBlock>& blocks);
+
+private:
+    ParallelOutputFile(const ParallelOutputFile&) = delete;
+    ParallelOutputFile& operator=(const ParallelOutputFile&) = delete;
+
+
+    std::string _fileName;
+    MPI_File _file;
+};
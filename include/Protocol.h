@@ -0,0 +1,215 @@
+#pragma once
+
+#include <mpi.h>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define PROTOCOL_TAG_PARAGRAPH 0
+
+// Master -> worker, OUTPUT_MPI_IO builds only: file offsets of the worker's paragraphs (int64_t, ascending paragraph IDs)
+#define PROTOCOL_TAG_OUTPUT_OFFSETS 1
+
+// Worker -> Master, OUTPUT_MMAP builds only: processed paragraph texts, ascending paragraph IDs, no frame headers
+#define PROTOCOL_TAG_OUTPUT_PAYLOAD 2
+
+// Output modes (see Master.h) in which the workers send back only the sizes of the processed paragraphs (FRAME_FLAG_SIZE)
+#if defined(OUTPUT_MPI_IO) && defined(OUTPUT_MMAP)
+    #error "OUTPUT_MPI_IO and OUTPUT_MMAP can't be enabled at the same time"
+#endif
+#if defined(OUTPUT_MPI_IO) || defined(OUTPUT_MMAP)
+    #define PROTOCOL_SIZE_FRAMES
+#endif
+
+// Payloads up to this size are copied into an envelope, larger ones are sent alone and in place using a derived datatype
+#define PROTOCOL_COPY_THRESHOLD (16 * 1024)
+
+// An envelope is sent as soon as one more frame would push it over any of these limits
+#define PROTOCOL_ENVELOPE_MAX_SIZE (64 * 1024)
+#define PROTOCOL_ENVELOPE_MAX_FRAMES 256
+
+// No message (envelope or in place frame) is larger than this, so receivers can post fixed size buffers (MPI_Irecv)
+// Payloads that don't fit are split into several frames, all but the last one flagged with FRAME_FLAG_MORE
+#define PROTOCOL_MAX_MESSAGE_SIZE (1024 * 1024)
+
+// Number of envelopes a writer may have on the wire (MPI_Isend) while it fills the next one
+#define PROTOCOL_SEND_RING_SIZE 4
+
+
+// Paragraphs travel as frames: a fixed size header followed by the paragraph text
+// Small frames are packed back to back into envelopes (one MPI message per envelope), so short paragraphs don't pay
+// the per-message latency one by one. The receiver doesn't know the envelope size beforehand, it finds it out with
+// MPI_Probe/MPI_Get_count, or it receives into a PROTOCOL_MAX_MESSAGE_SIZE buffer
+
+namespace Protocol
+{
+    enum eFrameFlags
+    {
+        FRAME_FLAG_NONE   = 0x00,
+        FRAME_FLAG_FINISH = 0x01,   // no more paragraphs will be sent (the frame has no payload)
+        FRAME_FLAG_MORE   = 0x02,   // the payload continues in the next frame (same paragraph ID)
+        FRAME_FLAG_GRANT  = 0x04,   // worker -> Master: the payload is a CreditGrant (no paragraph ID)
+        FRAME_FLAG_SIZE   = 0x08,   // worker -> Master: the payload is the size of the processed paragraph (int64_t), not its text
+    };
+
+    struct FrameHeader
+    {
+        int32_t paragraphId;
+        int32_t length;
+        int32_t flags;
+    };
+
+    // Flow control window announced by a worker before it accepts any paragraph
+    // The Master never has more than this much paragraph text (or this many paragraphs) outstanding at the worker;
+    // the credits of a paragraph come back once the Master has written its result (or, with PROTOCOL_SIZE_FRAMES, once
+    // its SIZE frame is received), so no explicit credit message is needed
+    struct CreditGrant
+    {
+        int64_t maxBytes;
+        int64_t maxParagraphs;
+    };
+
+    // Master side of the flow control window of one worker. Blocks the sender until the worker has room for a paragraph
+    class CreditGate
+    {
+    public:
+        CreditGate();
+
+        void Grant(const CreditGrant& grant);
+
+        // A paragraph larger than the whole window is let through once nothing else is outstanding
+        bool TryAcquire(size_t bytes);
+        void Acquire(size_t bytes);
+        void Release(size_t bytes);
+
+    private:
+        bool CanAcquire(size_t bytes) const;
+
+
+        std::mutex _mutex;
+        std::condition_variable _condVar;
+        bool _granted;
+        CreditGrant _grant;
+        size_t _outstandingBytes;
+        size_t _outstandingParagraphs;
+    };
+
+    // Funnels the sends of several threads through the only thread that is allowed to call MPI (MPI_THREAD_FUNNELED)
+    // Producers push messages and wait for their completion flags; the comm thread starts and completes the sends
+    class SendQueue
+    {
+    public:
+        SendQueue();
+
+        // Producer side. `pending` is cleared (under the queue's lock) once the send has completed
+        // A message is either a plain buffer or, when `payload` is set, a frame header glued to a payload in place
+        void Push(int destRank, const void* buffer, int length, const char* payload, int payloadLength, bool* pending);
+        void WaitForCompletion(const bool* pending);
+
+        // Comm thread side. Starts the queued sends and completes the finished ones; returns true if anything happened
+        bool Progress();
+        bool IsDrained();
+        void WaitForMessages(int timeoutUs);
+
+    private:
+        struct QueuedSend
+        {
+            int destRank;
+            const void* buffer;
+            int length;
+            const char* payload;
+            int payloadLength;
+            bool* pending;
+        };
+
+        std::mutex _mutex;
+        std::condition_variable _pushedCondVar;
+        std::condition_variable _completedCondVar;
+        std::deque<QueuedSend> _queuedSends;
+
+        // only touched by the comm thread
+        std::vector<MPI_Request> _requests;
+        std::vector<bool*> _pendingFlags;
+    };
+
+    // Batches the frames sent to one rank
+    // Envelopes are sent with MPI_Isend from a ring of buffers, so the caller keeps producing frames while the previous
+    // envelopes are still on the wire; it only stalls when the whole ring is in flight
+    // With a SendQueue, the writer makes no MPI call at all, the sends are started by the queue's comm thread
+    // Only one thread may use a writer, and no other thread may send paragraphs to the same rank
+    class EnvelopeWriter
+    {
+    public:
+        EnvelopeWriter(int destRank, size_t maxSize = PROTOCOL_ENVELOPE_MAX_SIZE, int maxFrames = PROTOCOL_ENVELOPE_MAX_FRAMES);
+        EnvelopeWriter(int destRank, SendQueue* sendQueue, size_t maxSize = PROTOCOL_ENVELOPE_MAX_SIZE, int maxFrames = PROTOCOL_ENVELOPE_MAX_FRAMES);
+        ~EnvelopeWriter();
+
+        // Large payloads are sent in place: the caller must keep them valid until Finish() returns
+        void Append(int paragraphId, const char* payload, int length, int flags = FRAME_FLAG_NONE);
+
+        // Same as Append, but the writer keeps the payload alive by itself until it's sent
+        void AppendOwned(int paragraphId, std::string&& payload);
+
+        void Flush();
+
+        // Sends the FINISH frame along with everything that is still buffered and waits for all the sends to complete
+        void Finish();
+
+    private:
+        struct SendSlot
+        {
+            std::vector<char> envelope;                         // frames copied back to back (empty when the slot sends a payload in place)
+            std::shared_ptr<const std::string> ownedPayload;    // in place payload handed over by AppendOwned (shared by all its fragments)
+            FrameHeader header;                                 // header of the in place payload
+            bool pending;                                       // in flight through the SendQueue
+        };
+
+        SendSlot& AcquireCurrentSlot();
+        void SendCurrentSlot(const void* buffer, int length, const char* payload, int payloadLength);
+        void SendInPlace(int paragraphId, const char* payload, int length, int flags, const std::shared_ptr<const std::string>& ownedPayload);
+        void WaitForSends();
+
+
+        int _destRank;
+        SendQueue* _sendQueue;
+        size_t _maxSize;
+        int _maxFrames;
+
+        std::vector<SendSlot> _slots;
+        std::vector<MPI_Request> _requests;
+        size_t _currentSlot;
+        int _numFrames;
+    };
+
+    // Receives the next envelope from `sourceRank` and iterates over its frames
+    class EnvelopeReader
+    {
+    public:
+        EnvelopeReader();
+
+        void Receive(int sourceRank);
+
+        // Same as Receive, but returns false right away if no envelope has arrived yet
+        bool TryReceive(int sourceRank);
+
+        // Non-blocking receive: the envelope can be read after `request` completes and CompleteReceive is called
+        void PostReceive(int sourceRank, MPI_Request& request);
+        void CompleteReceive(const MPI_Status& status);
+
+        // The payload points inside the reader's buffer and stays valid until the next Receive
+        bool NextFrame(FrameHeader& header, const char*& payload);
+
+    private:
+        void ReceiveProbed(const MPI_Status& status);
+
+
+        int _sourceRank;
+        std::vector<char> _envelope;    // only grows; the current envelope is its first _envelopeLength bytes
+        size_t _envelopeLength;
+        size_t _position;
+    };
+}
@@ -1,18 +1,30 @@
 #pragma once
 
 #include <mutex>
+#include <atomic>
+#include <memory>
 #include <thread>
 #include <vector>
-#include <queue>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <condition_variable>
 
+// Capacity of the job queue, must be a power of 2. When the queue is full, AddJob sleeps until a job is taken out
+// (a worker's credit window doesn't bound the number of jobs: a paragraph of short lines can be split in many more)
+#define THREAD_POOL_QUEUE_SIZE (16384)
+
+// How many times an idle thread looks for a job (yielding in between) before it goes to sleep
+#define THREAD_POOL_SPIN_COUNT (64)
+
 
 // This implementation assumes that only 1 thread "owns" the pool
 // So, only the thread that `Start`-ed the pool is allowed to enqueue new jobs, wait for completion or shut it down
 
 // This assumption is respected by the Worker code because only the Receive/Send thread interacts with the pool
 
+// The jobs are kept in a bounded lock-free queue (Vyukov's MPMC ring): adding and taking a job costs a CAS, no mutex
+// The mutex and the condition variables are only used to park the idle threads and to wait for completion
 class SimpleThreadPool
 {
 public:
@@ -27,14 +39,39 @@ public:
     void WaitForJobsToComplete();
 
 private:
+    struct Slot
+    {
+        std::atomic<size_t> sequence;   // the slot is free for position `sequence`, or holds its job if it's `position + 1`
+        std::function<void()> job;
+    };
+
     void Executor();
+    void Park();
+
+    bool TryPush(std::function<void()>& job);
+    bool TryPop(std::function<void()>& job);
+    bool HasReadyJob() const;
+    bool HasFreeSlot() const;
 
 
     std::vector<std::thread> _threads;
-    std::queue<std::function<void()>> _queueJobs;
-    std::mutex _queueMutex;
+    std::unique_ptr<Slot[]> _slots;
+
+    // the positions are written by different threads, keep them on separate cache lines
+    char _padding0[64];
+    std::atomic<size_t> _enqueuePos;
+    char _padding1[64];
+    std::atomic<size_t> _dequeuePos;
+    char _padding2[64];
+
+    std::atomic<int64_t> _pendingJobs;      // queued + running
+    std::atomic<int> _numParked;
+    std::atomic<int> _numFullWaiters;       // AddJob calls sleeping on a full queue
+
+    std::mutex _parkMutex;
     std::condition_variable _queueCondVar;
+    std::condition_variable _freeSlotCondVar;
     std::condition_variable _finishJobsCondVar;
 
-    bool _shutDown;
+    std::atomic<bool> _shutDown;
 };
@@ -1,23 +1,55 @@
 #pragma once
 
-#include <string>
-
 
 namespace Utils
 {
-    bool IsConsonant(char ch);
-    void Reverse(std::string& str);
+    // Properties of one byte; ASCII letters only, exactly like the ctype functions in the "C" locale
+    struct CharTraits
+    {
+        bool isLetter;
+        bool isConsonant;
+        char upper;
+        char lower;
+    };
 
-    template <class ContainerT>
-    void Split(const std::string& str, ContainerT& cont, char delim = ' ')
+    namespace Detail
     {
-        size_t current, previous = 0;
-        current = str.find(delim);
-        while (current != std::string::npos) {
-            cont.push_back(str.substr(previous, current - previous));
-            previous = current + 1;
-            current = str.find(delim, previous);
+        constexpr bool IsUpperLetter(int ch) { return ch >= 'A' && ch <= 'Z'; }
+        constexpr bool IsLowerLetter(int ch) { return ch >= 'a' && ch <= 'z'; }
+        constexpr char ToLower(int ch) { return static_cast<char>(IsUpperLetter(ch) ? ch + ('a' - 'A') : ch); }
+        constexpr char ToUpper(int ch) { return static_cast<char>(IsLowerLetter(ch) ? ch - ('a' - 'A') : ch); }
+        constexpr bool IsVowel(char lower) { return lower == 'a' || lower == 'e' || lower == 'i' || lower == 'o' || lower == 'u'; }
+
+        constexpr CharTraits MakeCharTraits(int ch)
+        {
+            return CharTraits{
+                IsUpperLetter(ch) || IsLowerLetter(ch),
+                (IsUpperLetter(ch) || IsLowerLetter(ch)) && !IsVowel(ToLower(ch)),
+                ToUpper(ch),
+                ToLower(ch)
+            };
         }
-        cont.push_back(str.substr(previous, current - previous));
-    };
+
+        // C++11 has no std::index_sequence: the table entries are expanded from a hand made index pack
+        template <int... Idx>
+        struct CharTable
+        {
+            static constexpr CharTraits entries[sizeof...(Idx)] = { MakeCharTraits(Idx)... };
+        };
+
+        template <int... Idx>
+        constexpr CharTraits CharTable<Idx...>::entries[sizeof...(Idx)];
+
+        template <int N, int... Idx>
+        struct MakeCharTable : MakeCharTable<N - 1, N - 1, Idx...> {};
+
+        template <int... Idx>
+        struct MakeCharTable<0, Idx...>
+        {
+            typedef CharTable<Idx...> Type;
+        };
+    }
+
+    // Indexed by unsigned byte value, generated at compile time
+    typedef Detail::MakeCharTable<256>::Type CharTable;
 }
@@ -1,77 +1,155 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <list>
 
+#include "Kernels.h"
 #include "Nodes.h"
+#include "ParallelOutputFile.h"
+#include "Protocol.h"
 #include "SimpleThreadPool.h"
 
 #define LINES_PER_WORKER_THREAD (20)
 
+// How long the comm thread sleeps when there is nothing to receive and no paragraph has been processed meanwhile
+#define WORKER_POLL_INTERVAL_US (50)
 
+// Flow control window granted to the Master: at most this much paragraph text / this many paragraphs
+// are queued on the worker at any time, whatever the size of the input file
+#define WORKER_CREDIT_BYTES (16 * 1024 * 1024)
+#define WORKER_CREDIT_PARAGRAPHS (4096)
+
+
+// Genre independent part of a worker: communication with the Master, paragraph bookkeeping and the thread pool
+// The genre transform is only known by GenreWorker (below), which schedules the jobs of every paragraph
 class Worker : public Node
 {
-protected:
-    Worker();
-    virtual void ProcessLine(std::string& line) = 0;
-
 public:
     virtual ~Worker() override;
     virtual void Start() override;
 
-private:
-    void CommThread();
-    void CommReceive();
-    void CommSend();
-
-    void ReceiveParagraph(int globalParagraphIdx);
-    void ProcessLastParagraph();
-
+protected:
+    Worker();
 
+    // The received text is kept as a single buffer, split in chunks of LINES_PER_WORKER_THREAD lines (one job each)
+    // Chunk i is [chunkOffsets[i], chunkOffsets[i + 1]) and it's processed into [outputOffsets[i], outputOffsets[i + 1])
     struct Paragraph
     {
         int globalIdx;
-        std::vector<std::string> lines;
+        std::string text;
+        std::vector<size_t> chunkOffsets;
+        std::string output;
+        std::vector<size_t> outputOffsets;
+        std::atomic<int> pendingJobs;
     };
 
-    std::list<Worker::Paragraph> _paragraphsList;
-    int _availableCores;
+    // Sizes the output of a received paragraph and adds its jobs to the pool; the last job calls OnParagraphProcessed
+    virtual void ProcessParagraph(std::list<Worker::Paragraph>::iterator paragraph) = 0;
+    void OnParagraphProcessed(std::list<Worker::Paragraph>::iterator paragraph);
+
     SimpleThreadPool _threadPool;
-};
 
-class WorkerHorror : public Worker
-{
-public:
-    virtual ~WorkerHorror() override {};
+private:
+    void CommThread();
+    bool CommReceive(Protocol::EnvelopeReader& reader, bool& finished);
+    bool CommSend(Protocol::EnvelopeWriter& writer);
+    void WaitForProcessedParagraphs(bool receiving);
 
-protected:
-    virtual void ProcessLine(std::string& line) override;
-};
+    void ReceiveParagraph(int globalParagraphIdx, const char* text, int length);
+    void ProcessLastParagraph();
 
-class WorkerComedy : public Worker
-{
-public:
-    virtual ~WorkerComedy() override {};
+#ifdef PROTOCOL_SIZE_FRAMES
+    void SortOutputParagraphs();
+#endif
+#ifdef OUTPUT_MPI_IO
+    void WriteOutputParagraphs();
+#endif
+#ifdef OUTPUT_MMAP
+    void SendOutputParagraphs();
+#endif
 
-protected:
-    virtual void ProcessLine(std::string& line) override;
-};
 
-class WorkerFantasy : public Worker
-{
-public:
-    virtual ~WorkerFantasy() override {};
+    // only the comm thread adds or removes paragraphs, the pool threads just process the lines of their own paragraph
+    std::list<Worker::Paragraph> _paragraphsList;
+    std::string _partialParagraph;
+    int _availableCores;
 
-protected:
-    virtual void ProcessLine(std::string& line) override;
+    // paragraphs whose jobs have all completed, waiting to be sent back by the comm thread
+    std::vector<std::list<Worker::Paragraph>::iterator> _processedParagraphs;
+    std::mutex _processedMutex;
+    std::condition_variable _processedCondVar;
+
+#ifdef PROTOCOL_SIZE_FRAMES
+    // processed paragraphs (global ID, text) kept until the Master knows the sizes of all the paragraphs
+    std::vector<std::pair<int, std::string>> _outputParagraphs;
+#endif
+#ifdef OUTPUT_MPI_IO
+    ParallelOutputFile _outputFile;
+#endif
 };
 
-class WorkerSF : public Worker
+// Worker specialized at compile time for one genre kernel (see Kernels.h)
+// There is no virtual call left on the processing path: each job makes a single call through the kernel table that was
+// picked once for the CPU (see KernelTable.h)
+// The genre is picked once, in main(), when the worker object is created
+template <class KernelT>
+class GenreWorker : public Worker
 {
 public:
-    virtual ~WorkerSF() override {};
+    virtual ~GenreWorker() override {};
 
 protected:
-    virtual void ProcessLine(std::string& line) override;
+    virtual void ProcessParagraph(std::list<Worker::Paragraph>::iterator paragraphIt) override
+    {
+        auto& paragraph = *paragraphIt;
+        auto numOfChunks = paragraph.chunkOffsets.size() - 1;
+
+        if (KernelT::IN_PLACE) {
+            // the received text becomes the output buffer, nothing is allocated
+            paragraph.output.swap(paragraph.text);
+        }
+        else {
+            // the output length of every chunk is known before processing it, so all the chunks are written straight to
+            // their final place and the output buffer is allocated only once
+            paragraph.outputOffsets.resize(numOfChunks + 1);
+            paragraph.outputOffsets[0] = 0;
+            for (size_t i = 0; i != numOfChunks; ++i) {
+                size_t chunkLength = paragraph.chunkOffsets[i + 1] - paragraph.chunkOffsets[i];
+                paragraph.outputOffsets[i + 1] = paragraph.outputOffsets[i] + KernelT::GetOutputLength(&paragraph.text[paragraph.chunkOffsets[i]], chunkLength);
+            }
+            paragraph.output.resize(paragraph.outputOffsets[numOfChunks]);
+        }
+
+        // the counter must be set before the first job is added, jobs may complete while the rest are still being added
+        paragraph.pendingJobs = numOfChunks;
+        if (paragraph.pendingJobs == 0) {
+            OnParagraphProcessed(paragraphIt);
+            return;
+        }
+
+        for (size_t i = 0; i != numOfChunks; ++i) {
+            _threadPool.AddJob([this, i, paragraphIt]() {
+                Worker::Paragraph& paragraph = *paragraphIt;
+                const std::string& input = KernelT::IN_PLACE ? paragraph.output : paragraph.text;
+                const std::vector<size_t>& outputOffsets = KernelT::IN_PLACE ? paragraph.chunkOffsets : paragraph.outputOffsets;
+                size_t chunkLength = paragraph.chunkOffsets[i + 1] - paragraph.chunkOffsets[i];
+
+                KernelT::Transform(&input[paragraph.chunkOffsets[i]], chunkLength, &paragraph.output[outputOffsets[i]]);
+
+                // the last job of the paragraph hands it over to the comm thread
+                if (paragraph.pendingJobs.fetch_sub(1) == 1) {
+                    OnParagraphProcessed(paragraphIt);
+                }
+            });
+        }
+    }
 };
+
+typedef GenreWorker<Kernels::Horror> WorkerHorror;
+typedef GenreWorker<Kernels::Comedy> WorkerComedy;
+typedef GenreWorker<Kernels::Fantasy> WorkerFantasy;
+typedef GenreWorker<Kernels::SF> WorkerSF;
@@ -0,0 +1,87 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "KernelTable.h"
+#include "Kernels.h"
+#include "Logger.h"
+
+
+namespace
+{
+    // The best variant the CPU supports; the KERNELS_TARGET environment variable (baseline, avx2, avx512) can pick a
+    // lower one, e.g. to compare them on the same machine
+    const Kernels::KernelTable& SelectKernelTable()
+    {
+        const Kernels::KernelTable* tables[] = { &Kernels::AVX512::TABLE, &Kernels::AVX2::TABLE, &Kernels::Baseline::TABLE };
+        const char* requested = getenv("KERNELS_TARGET");
+        bool found = (requested == nullptr);
+
+        for (const Kernels::KernelTable* table : tables) {
+            found = found || strcmp(requested, table->name) == 0;
+            if (found && Kernels::IsSupported(*table)) {
+                return *table;
+            }
+        }
+
+        LOG_WARNING("Unknown kernels target \"{}\", using the baseline ones", requested);
+        return Kernels::Baseline::TABLE;
+    }
+
+    inline const Kernels::KernelTable& GetKernelTable()
+    {
+        static const Kernels::KernelTable& table = SelectKernelTable();
+        return table;
+    }
+}
+
+
+namespace Kernels
+{
+    bool IsSupported(const KernelTable& table)
+    {
+        __builtin_cpu_init();
+
+        if (&table == &AVX512::TABLE) {
+            return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && IsSupported(AVX2::TABLE);
+        }
+        if (&table == &AVX2::TABLE) {
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt") && __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2");
+        }
+        return true;
+    }
+
+    size_t Horror::GetOutputLength(const char* input, size_t length)
+    {
+        return GetKernelTable().horrorOutputLength(input, length);
+    }
+
+    void Horror::Transform(const char* input, size_t length, char* output)
+    {
+        GetKernelTable().horrorTransform(input, length, output);
+    }
+
+    void Comedy::Transform(const char* input, size_t length, char* output)
+    {
+        GetKernelTable().comedyTransform(input, length, output);
+    }
+
+    void Fantasy::Transform(const char* input, size_t length, char* output)
+    {
+        GetKernelTable().fantasyTransform(input, length, output);
+    }
+
+    void SF::Transform(const char* input, size_t length, char* output)
+    {
+        GetKernelTable().sfTransform(input, length, output);
+    }
+
+    size_t FindDoubleNewLine(const char* data, size_t pos, size_t size)
+    {
+        return GetKernelTable().findDoubleNewLine(data, pos, size);
+    }
+
+    const char* GetTargetName()
+    {
+        return GetKernelTable().name;
+    }
+}
@@ -0,0 +1,5 @@
+// Kernels built for AVX2 (the ISA flags of this file are set in the Makefile)
+#define KERNELS_TARGET AVX2
+#define KERNELS_TARGET_NAME "avx2"
+
+#include "KernelsImpl.h"
@@ -0,0 +1,5 @@
+// Kernels built for AVX-512 (the ISA flags of this file are set in the Makefile)
+#define KERNELS_TARGET AVX512
+#define KERNELS_TARGET_NAME "avx512"
+
+#include "KernelsImpl.h"
@@ -0,0 +1,5 @@
+// Kernels built for baseline x86-64 (the ISA flags of this file are set in the Makefile)
+#define KERNELS_TARGET Baseline
+#define KERNELS_TARGET_NAME "baseline"
+
+#include "KernelsImpl.h"
@@ -3,6 +3,7 @@
 #include <unistd.h>
 
 #include "Logger.h"
+#include "Kernels.h"
 #include "Nodes.h"
 #include "Master.h"
 #include "Worker.h"
@@ -10,11 +11,16 @@
 int main (int argc, char *argv[])
 {
     int numtasks, rank, provided = -1;
+#ifdef COMM_FUNNELED
+    int required = MPI_THREAD_FUNNELED;
+#else
+    int required = MPI_THREAD_MULTIPLE;
+#endif
     auto& logger = Logger::GetInstance();
     Node* node = nullptr;
     std::string nodeName;
 
-    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
+    MPI_Init_thread(&argc, &argv, required, &provided);
     MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
@@ -26,9 +32,11 @@ int main (int argc, char *argv[])
 #endif
 
     LOG_DEBUG("Started process ID: {}", getpid());
+    // picks the kernel variant now, not at the first paragraph
+    LOG_DEBUG("Using the {} kernels", Kernels::GetTargetName());
 
-    if (provided != MPI_THREAD_MULTIPLE) {
-        LOG_FATAL("MPI_THREAD_MULTIPLE is not supported (provided = {})", provided);
+    if (provided < required) {
+        LOG_FATAL("MPI thread support level {} is not supported (provided = {})", required, provided);
     }
 
     switch (rank) {
@@ -0,0 +1,104 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Logger.h"
+#include "MappedFile.h"
+
+
+MappedFile::MappedFile() : _fd(-1), _data(nullptr), _size(0), _writable(false), _modificationTime()
+{
+
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+bool MappedFile::Open(const std::string& fileName)
+{
+    struct stat fileStat;
+
+    Close();
+
+    _fd = open(fileName.c_str(), O_RDONLY);
+    if (_fd < 0) {
+        LOG_ERROR("Couldn't open file: \"{}\"", fileName);
+        return false;
+    }
+
+    if (fstat(_fd, &fileStat) < 0) {
+        LOG_ERROR("Couldn't stat file: \"{}\"", fileName);
+        Close();
+        return false;
+    }
+
+    _size = fileStat.st_size;
+    _modificationTime = fileStat.st_mtim;
+    if (_size == 0) {
+        // mmap refuses empty mappings, an empty file is simply represented by a null buffer
+        return true;
+    }
+
+    void* data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+    if (data == MAP_FAILED) {
+        LOG_ERROR("Couldn't map file: \"{}\" ({} bytes)", fileName, _size);
+        Close();
+        return false;
+    }
+
+    _data = static_cast<char*>(data);
+    madvise(_data, _size, MADV_SEQUENTIAL);
+    return true;
+}
+
+// Creates (or truncates) the file, resizes it to `size` bytes and maps it; the writes go straight to the file
+bool MappedFile::Create(const std::string& fileName, size_t size)
+{
+    Close();
+
+    _fd = open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (_fd < 0) {
+        LOG_ERROR("Couldn't create file: \"{}\"", fileName);
+        return false;
+    }
+
+    if (ftruncate(_fd, size) < 0) {
+        LOG_ERROR("Couldn't resize file: \"{}\" ({} bytes)", fileName, size);
+        Close();
+        return false;
+    }
+
+    _size = size;
+    _writable = true;
+    if (_size == 0) {
+        return true;
+    }
+
+    void* data = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (data == MAP_FAILED) {
+        LOG_ERROR("Couldn't map file: \"{}\" ({} bytes)", fileName, _size);
+        Close();
+        return false;
+    }
+
+    _data = static_cast<char*>(data);
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (_data) {
+        munmap(_data, _size);
+        _data = nullptr;
+    }
+    if (_fd >= 0) {
+        close(_fd);
+        _fd = -1;
+    }
+    _size = 0;
+    _writable = false;
+    _modificationTime = timespec();
+}
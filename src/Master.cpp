@@ -1,11 +1,15 @@
 #include <mpi.h>
+#include <algorithm>
+#include <cstring>
 #include <thread>
 
 #include "Logger.h"
 #include "Master.h"
+#include "ParagraphIndex.h"
+#include "Protocol.h"
 
 
-Master::Master(const std::string& inFile) : _paragraphsListInitialized(false)
+Master::Master(const std::string& inFile)
 {
     size_t dotIdx = inFile.find_last_of('.');
 
@@ -15,6 +19,11 @@ Master::Master(const std::string& inFile) : _paragraphsListInitialized(false)
 
     _inFileName = inFile;
     _outFileName = inFile.substr(0, dotIdx) + ".out";
+    _indexFileName = _inFileName + ".idx";
+#ifdef OUTPUT_MMAP
+    _numSizedWorkers = 0;
+    _outputFileCreated = false;
+#endif
 }
 
 Master::~Master()
@@ -26,17 +35,61 @@ void Master::Start()
 {
     LOG_DEBUG("Master node started (inFile: \"{}\")", _inFileName);
 
+    if (!_inFile.Open(_inFileName)) {
+        LOG_FATAL("Couldn't open input file: \"{}\"", _inFileName);
+    }
+
+    // the input file is scanned only once, the threads below just pick their own paragraphs from the list
+    // paragraphs are kept as ranges of the mapped file, so they are sent straight from the page cache
+#ifdef ENABLE_PARAGRAPH_INDEX
+    if (!ParagraphIndex::Load(_indexFileName, _inFile, _inputParagraphs)) {
+        ParagraphScanner scanner(_inFile.GetData(), _inFile.GetSize());
+        scanner.Scan(_inputParagraphs);
+        ParagraphIndex::Save(_indexFileName, _inFile, _inputParagraphs);
+    }
+#else
+    ParagraphScanner scanner(_inFile.GetData(), _inFile.GetSize());
+    scanner.Scan(_inputParagraphs);
+#endif
+
+#if defined(OUTPUT_MPI_IO)
+    // the workers wait for the output file to be opened (collectively) before they accept any paragraph
+    _outputFile.Open(_outFileName);
+    _outputSizes.resize(_inputParagraphs.size());
+#elif defined(OUTPUT_MMAP)
+    // the output file is created once all the sizes are known
+    _outputSizes.resize(_inputParagraphs.size());
+#else
+    // the results are written to the output file in input order while the workers are still processing the rest
+    // the credits of a paragraph come back only once it's written: the results waiting for an earlier (slow) paragraph
+    // can't take more memory than the workers' credit windows
+    _outputWriter.Start(_outFileName, _inputParagraphs, [this](int paragraphId) {
+        const ParagraphInfo& paragraph = _inputParagraphs[paragraphId];
+        _credits[paragraph.paragraphType - Node::RANK_WORKER_HORROR].Release(paragraph.length);
+    });
+#endif
+
     std::thread threads[MASTER_NUM_THREADS];
 
     for (int i = 0; i != MASTER_NUM_THREADS; ++i) {
         threads[i] = std::thread(&Master::WorkerThread, this, i+Node::RANK_WORKER_HORROR);     
     }
 
+#ifdef MASTER_EVENT_DRIVEN_RECEIVE
+    ReceiveAndReassembleFromAllWorkerNodes();
+#endif
+
     for (int i = 0; i != MASTER_NUM_THREADS; ++i) {
         threads[i].join();      
     }
 
-    WriteOutputFile();
+#if defined(OUTPUT_MPI_IO)
+    WriteOutputFileParallel();
+#elif defined(OUTPUT_MMAP)
+    _outputFile.Close();
+#else
+    _outputWriter.Finish();
+#endif
 }
 
 void Master::WorkerThread(int workerNode)
@@ -48,125 +101,332 @@ void Master::WorkerThread(int workerNode)
 
     LOG_DEBUG("Master worker thread started for node: {}", paragraphName);
 
-    ParseAndSendToWorkerNode(workerNode, paragraphName);
-    ReceiveAndReassembleFromWorkerNode(workerNode, paragraphName);
+#ifdef MASTER_EVENT_DRIVEN_RECEIVE
+    // the results of all workers are collected by the Master's main thread
+    SendToWorkerNode(workerNode, paragraphName);
+#else
+    // the worker streams results back while it still receives paragraphs, so they are collected on a separate thread
+    std::thread receiveThread(&Master::ReceiveAndReassembleFromWorkerNode, this, workerNode, paragraphName);
+
+    SendToWorkerNode(workerNode, paragraphName);
+    receiveThread.join();
+#endif
 
     LOG_DEBUG("Master worker thread ended for node: {}", paragraphName);
 }
 
-void Master::ParseAndSendToWorkerNode(int workerNode, const std::string& paragraphName)
+void Master::SendToWorkerNode(int workerNode, const std::string& paragraphName)
 {
-    enum eParserStates {
-        WAITING_FOR_PARAGRAPH,
-        SKIPPING_UNTIL_NEXT_PARAGRAPH,
-        READING_PARAGRAPH   
-    };
+    LOG_DEBUG("Sending paragraphs to worker node: {}", paragraphName);
+    (void)paragraphName; // silent "unused variable" warning when compiled with LOGGING disabled
+
+#ifdef COMM_FUNNELED
+    Protocol::EnvelopeWriter writer(workerNode, &_sendQueue);
+#else
+    Protocol::EnvelopeWriter writer(workerNode);
+#endif
+    Protocol::CreditGate& credits = _credits[workerNode - Node::RANK_WORKER_HORROR];
+    int numParagraphs = _inputParagraphs.size();
+
+    for (int paragraphIdx = 0; paragraphIdx != numParagraphs; ++paragraphIdx) {
+        const ParagraphInfo& paragraph = _inputParagraphs[paragraphIdx];
+        if (paragraph.paragraphType != workerNode) {
+            continue;
+        }
 
-    int state = WAITING_FOR_PARAGRAPH;
-    int paragraphIdx = -1;
-    std::string line, fullParagraph;
-    std::ifstream inFile(_inFileName);
+        const char* paragraphText = _inFile.GetData() + paragraph.offset;
+        int paragraphLength = paragraph.length;
+
+        // the buffered frames count as outstanding too: they must reach the worker before waiting for its results
+#ifndef PROTOCOL_SIZE_FRAMES
+        if (!_outputWriter.IsInWindow(paragraphIdx)) {
+            writer.Flush();
+            _outputWriter.WaitForWindow(paragraphIdx);
+        }
+#endif
+        if (!credits.TryAcquire(paragraph.length)) {
+            writer.Flush();
+            credits.Acquire(paragraph.length);
+        }
 
-    LOG_DEBUG("Parsing and sending paragraphs to worker node: {}", paragraphName);
+        if (paragraphLength != 0 && paragraphText[paragraphLength - 1] != '\n') {
+            // the last line of the file has no '\n', but the workers expect every line to be terminated
+            // the patched copy is handed over to the writer, it may still be on the wire after this iteration
+            std::string lastParagraph(paragraphText, paragraphLength);
+            lastParagraph += '\n';
 
-    if (!inFile) {
-        LOG_FATAL("\"{}\" paragraph handler couldn't open file: \"{}\"", paragraphName, _inFileName);
+            writer.AppendOwned(paragraphIdx, std::move(lastParagraph));
+            continue;
+        }
+
+        writer.Append(paragraphIdx, paragraphText, paragraphLength);
     }
 
-    while (std::getline(inFile, line)) {
-        switch (state) {
-        case WAITING_FOR_PARAGRAPH:
-            paragraphIdx++;
+    writer.Finish();
+}
 
-            if (line == paragraphName) {
-                state = READING_PARAGRAPH;
-                MPI_Send(&paragraphIdx, 1, MPI_INT, workerNode, 0, MPI_COMM_WORLD);
-            } else {
-                state = SKIPPING_UNTIL_NEXT_PARAGRAPH;
-            }
-            break;
+void Master::ReceiveAndReassembleFromWorkerNode(int workerNode, const std::string& paragraphName)
+{
+    LOG_DEBUG("Process incoming messages from worker node: {}", paragraphName);
+    (void)paragraphName; // silent "unused variable" warning when compiled with LOGGING disabled
+
+    Protocol::EnvelopeReader reader;
+    bool finished = false;
+
+    while (!finished) {
+        reader.Receive(workerNode);
+        finished = ReassembleEnvelope(workerNode, reader);
+    }
 
-        case SKIPPING_UNTIL_NEXT_PARAGRAPH:
-            if (line.empty()) {
-                state = WAITING_FOR_PARAGRAPH;
+#ifdef OUTPUT_MMAP
+    std::vector<MPI_Request> requests;
+
+    WaitForOutputFile();
+    PostPayloadReceives(workerNode, requests);
+    MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+#endif
+}
+
+void Master::ReceiveAndReassembleFromAllWorkerNodes()
+{
+    LOG_DEBUG("Process incoming messages from all worker nodes");
+
+    std::vector<Protocol::EnvelopeReader> readers(MASTER_NUM_THREADS);
+    std::vector<MPI_Request> requests(MASTER_NUM_THREADS);
+    std::vector<MPI_Status> statuses(MASTER_NUM_THREADS);
+    std::vector<int> completed(MASTER_NUM_THREADS);
+    int numActiveWorkers = MASTER_NUM_THREADS;
+
+    // one receive is always posted for every worker that hasn't finished yet
+    for (int i = 0; i != MASTER_NUM_THREADS; ++i) {
+        readers[i].PostReceive(i + Node::RANK_WORKER_HORROR, requests[i]);
+    }
+
+#ifdef COMM_FUNNELED
+    // the sender threads can't touch MPI: their sends are started and completed here, between the receives
+    while (numActiveWorkers || !_sendQueue.IsDrained()) {
+        bool progress = _sendQueue.Progress();
+        int numCompleted;
+
+        MPI_Testsome(requests.size(), requests.data(), &numCompleted, completed.data(), statuses.data());
+        if (numCompleted == MPI_UNDEFINED) {
+            numCompleted = 0;
+        }
+        progress |= (numCompleted != 0);
+
+        for (int i = 0; i != numCompleted; ++i) {
+            int workerIdx = completed[i];
+            int workerNode = workerIdx + Node::RANK_WORKER_HORROR;
+
+            readers[workerIdx].CompleteReceive(statuses[i]);
+            if (ReassembleEnvelope(workerNode, readers[workerIdx])) {
+                numActiveWorkers--;
+                continue;
             }
-            break;
 
-        case READING_PARAGRAPH:
-            if (line.empty()) {
-                // entire paragraph read!
-                state = WAITING_FOR_PARAGRAPH;
+            readers[workerIdx].PostReceive(workerNode, requests[workerIdx]);
+        }
+
+        if (!progress) {
+            // a pushed envelope wakes this thread up, incoming messages don't: it has to come back and poll for them
+            _sendQueue.WaitForMessages(MASTER_POLL_INTERVAL_US);
+        }
+    }
+#else
+    while (numActiveWorkers) {
+        int numCompleted;
+
+        MPI_Waitsome(requests.size(), requests.data(), &numCompleted, completed.data(), statuses.data());
 
-                int paragraphLength = fullParagraph.length();
-                MPI_Send(&paragraphLength, 1, MPI_INT, workerNode, 0, MPI_COMM_WORLD);
-                MPI_Send(fullParagraph.c_str(), paragraphLength, MPI_CHAR, workerNode, 0, MPI_COMM_WORLD);
+        for (int i = 0; i != numCompleted; ++i) {
+            int workerIdx = completed[i];
+            int workerNode = workerIdx + Node::RANK_WORKER_HORROR;
 
-                fullParagraph.clear();
+            readers[workerIdx].CompleteReceive(statuses[i]);
+            if (ReassembleEnvelope(workerNode, readers[workerIdx])) {
+                // the request stays MPI_REQUEST_NULL, Waitsome ignores it from now on
+                numActiveWorkers--;
+                continue;
             }
-            else {
-                fullParagraph += line + '\n';
+
+            readers[workerIdx].PostReceive(workerNode, requests[workerIdx]);
+        }
+    }
+#endif
+
+#ifdef OUTPUT_MMAP
+    // all the sizes are known once every worker has finished
+    std::vector<MPI_Request> payloadRequests;
+
+    CreateOutputFile();
+    for (int i = 0; i != MASTER_NUM_THREADS; ++i) {
+        PostPayloadReceives(i + Node::RANK_WORKER_HORROR, payloadRequests);
+    }
+    MPI_Waitall(payloadRequests.size(), payloadRequests.data(), MPI_STATUSES_IGNORE);
+#endif
+}
+
+// Hands the paragraphs of a received envelope over to the output writer. Returns true after the FINISH frame
+bool Master::ReassembleEnvelope(int workerNode, Protocol::EnvelopeReader& reader)
+{
+    Protocol::FrameHeader header;
+    const char* payload;
+
+    Protocol::CreditGate& credits = _credits[workerNode - Node::RANK_WORKER_HORROR];
+
+    while (reader.NextFrame(header, payload)) {
+        if (header.flags & Protocol::FRAME_FLAG_FINISH) {
+            return true;
+        }
+
+        if (header.flags & Protocol::FRAME_FLAG_GRANT) {
+            Protocol::CreditGrant grant;
+
+            if (header.length != sizeof(grant)) {
+                LOG_FATAL("Invalid credit grant size received from worker node: {} (size: {})", workerNode, header.length);
             }
-            break;
+
+            memcpy(&grant, payload, sizeof(grant));
+            credits.Grant(grant);
+            continue;
         }
+
+        if (header.paragraphId < 0 || header.paragraphId >= static_cast<int>(_inputParagraphs.size()) ||
+            _inputParagraphs[header.paragraphId].paragraphType != workerNode) {
+            LOG_FATAL("Unexpected paragraph ID received from worker node: {} (ID: {})", workerNode, header.paragraphId);
+        }
+
+#ifdef PROTOCOL_SIZE_FRAMES
+        if (!(header.flags & Protocol::FRAME_FLAG_SIZE) || header.length != sizeof(int64_t)) {
+            LOG_FATAL("Expected a paragraph size from worker node: {} (ID: {})", workerNode, header.paragraphId);
+        }
+
+        memcpy(&_outputSizes[header.paragraphId], payload, sizeof(int64_t));
+
+        // the worker keeps the result until it's written, the Master only records its size: the credits can be used again
+        credits.Release(_inputParagraphs[header.paragraphId].length);
+#else
+        // large paragraphs arrive as several consecutive fragments; the credits are given back by the output writer
+        bool last = !(header.flags & Protocol::FRAME_FLAG_MORE);
+        _outputWriter.AppendResult(header.paragraphId, payload, header.length, last);
+#endif
     }
 
-    if (state == READING_PARAGRAPH) {
-        LOG_DEBUG("Invalid input file ending. Make sure it ends with an empty line. (last state: {}, last line parsed: \"{}\", file: \"{}\")", state, line, _inFileName);
+    return false;
+}
 
-        int paragraphLength = fullParagraph.length();
-        MPI_Send(&paragraphLength, 1, MPI_INT, workerNode, 0, MPI_COMM_WORLD);
-        MPI_Send(fullParagraph.c_str(), paragraphLength, MPI_CHAR, workerNode, 0, MPI_COMM_WORLD);
+#ifdef PROTOCOL_SIZE_FRAMES
+// Computes the offset of every paragraph in the output file (prefix sum over the sizes of all the paragraphs, header
+// included, in input order) and the header of every paragraph type. Returns the size of the output file
+int64_t Master::ComputeOutputLayout()
+{
+    int64_t offset = 0;
+
+    for (int rank = Node::RANK_MASTER; rank != Node::NUM_NODE_TYPES; ++rank) {
+        _paragraphHeaders[rank] = GetNodeNameFromRank(rank) + '\n';
     }
 
-    // this vector stores the content received from the worker nodes (paragraphs, same order as in input file)
-    // only 1 out of the 4 threads must resize it (otherwise it may lead to corrupted data)
-    // also, resizing the vector before sending the first FINISH message means that the modification will happen before any data is received from workers, so OOB writes are not possible
-    bool expected = false;
-    if (_paragraphsListInitialized.compare_exchange_strong(expected, true)) {
-        _paragraphsList.resize(paragraphIdx + 1);
-        LOG_DEBUG("Resized _paragraphsList to {} elements", paragraphIdx + 1);
+    _outputOffsets.resize(_inputParagraphs.size());
+    for (size_t paragraphIdx = 0; paragraphIdx != _inputParagraphs.size(); ++paragraphIdx) {
+        _outputOffsets[paragraphIdx] = offset;
+        offset += _paragraphHeaders[_inputParagraphs[paragraphIdx].paragraphType].length() + _outputSizes[paragraphIdx];
     }
 
-    paragraphIdx = -1;
-    MPI_Send(&paragraphIdx, 1, MPI_INT, workerNode, 0, MPI_COMM_WORLD);
+    return offset;
 }
+#endif
 
-void Master::ReceiveAndReassembleFromWorkerNode(int workerNode, const std::string& paragraphName)
+#ifdef OUTPUT_MPI_IO
+// Sends the workers the offsets of their own paragraphs and writes the headers of the paragraphs that no worker knows about
+void Master::WriteOutputFileParallel()
 {
-    LOG_DEBUG("Process incoming messages from worker node: {}", paragraphName);
-    (void)paragraphName; // silent "unused variable" warning when compiled with LOGGING disabled
+    std::vector<std::vector<int64_t>> workerOffsets(MASTER_NUM_THREADS);
+    std::vector<OutputBlock> blocks;
 
-    MPI_Status status;
-    int commandOrParagraphId;
-    int paragraphLength;
+    ComputeOutputLayout();
 
-    while (1) {
-        MPI_Recv(&commandOrParagraphId, 1, MPI_INT, workerNode, 0, MPI_COMM_WORLD, &status);
-        if (commandOrParagraphId < 0) {
-            // FINISH command
-            break;
+    for (size_t paragraphIdx = 0; paragraphIdx != _inputParagraphs.size(); ++paragraphIdx) {
+        int paragraphType = _inputParagraphs[paragraphIdx].paragraphType;
+
+        if (paragraphType == Node::RANK_MASTER) {
+            const std::string& paragraphHeader = _paragraphHeaders[paragraphType];
+            blocks.push_back({ _outputOffsets[paragraphIdx], paragraphHeader.c_str(), static_cast<int>(paragraphHeader.length()) });
+            continue;
         }
 
-        Master::Paragraph& paragraph = _paragraphsList[commandOrParagraphId];
-        paragraph.paragraphType = workerNode;
+        workerOffsets[paragraphType - Node::RANK_WORKER_HORROR].push_back(_outputOffsets[paragraphIdx]);
+    }
+
+    for (int i = 0; i != MASTER_NUM_THREADS; ++i) {
+        std::vector<int64_t>& offsets = workerOffsets[i];
+        MPI_Send(offsets.data(), offsets.size(), MPI_INT64_T, i + Node::RANK_WORKER_HORROR, PROTOCOL_TAG_OUTPUT_OFFSETS, MPI_COMM_WORLD);
+    }
 
-        MPI_Recv(&paragraphLength, 1, MPI_INT, workerNode, 0, MPI_COMM_WORLD, &status);
+    _outputFile.WriteBlocks(blocks);
+    _outputFile.Close();
 
-        paragraph.fullParagraph.resize(paragraphLength);
-        MPI_Recv(&paragraph.fullParagraph[0], paragraphLength, MPI_CHAR, workerNode, 0, MPI_COMM_WORLD, &status);
+    LOG_DEBUG("Output file written by all ranks");
+}
+#endif
+
+#ifdef OUTPUT_MMAP
+// Called by every receive thread once its worker has sent all the sizes; the last one creates the output file
+void Master::WaitForOutputFile()
+{
+    std::unique_lock<std::mutex> lock(_outputMutex);
+
+    if (++_numSizedWorkers == MASTER_NUM_THREADS) {
+        CreateOutputFile();
+        _outputFileCreated = true;
+        _outputCondVar.notify_all();
+        return;
     }
+
+    _outputCondVar.wait(lock, [this]() { return _outputFileCreated; });
 }
 
-void Master::WriteOutputFile()
+// Sizes and maps the output file and writes all the headers
+void Master::CreateOutputFile()
 {
-    std::ofstream outFile(_outFileName);
+    int64_t outputSize = ComputeOutputLayout();
+
+    if (!_outputFile.Create(_outFileName, outputSize)) {
+        LOG_FATAL("Couldn't create output file: \"{}\" ({} bytes)", _outFileName, outputSize);
+    }
 
-    if (!outFile) {
-        LOG_FATAL("Couldn't open file: \"{}\"", _outFileName);
+    char* outputData = _outputFile.GetWritableData();
+    for (size_t paragraphIdx = 0; paragraphIdx != _inputParagraphs.size(); ++paragraphIdx) {
+        const std::string& paragraphHeader = _paragraphHeaders[_inputParagraphs[paragraphIdx].paragraphType];
+        memcpy(outputData + _outputOffsets[paragraphIdx], paragraphHeader.c_str(), paragraphHeader.length());
     }
 
-    for (auto& paragraph : _paragraphsList) {
-        outFile << GetNodeNameFromRank(paragraph.paragraphType) << '\n';
-        outFile << paragraph.fullParagraph;
+    LOG_DEBUG("Output file created ({} bytes)", outputSize);
+}
+
+// The worker sends its texts in ascending ID order, split in messages of at most PROTOCOL_MAX_MESSAGE_SIZE bytes
+// Each one is received right behind the header of its paragraph, in the mapped output file
+void Master::PostPayloadReceives(int workerNode, std::vector<MPI_Request>& requests)
+{
+    char* outputData = _outputFile.GetWritableData();
+    size_t headerLength = _paragraphHeaders[workerNode].length();
+
+    for (size_t paragraphIdx = 0; paragraphIdx != _inputParagraphs.size(); ++paragraphIdx) {
+        if (_inputParagraphs[paragraphIdx].paragraphType != workerNode) {
+            continue;
+        }
+
+        char* payload = outputData + _outputOffsets[paragraphIdx] + headerLength;
+        int64_t length = _outputSizes[paragraphIdx];
+
+        while (length > 0) {
+            int fragmentLength = std::min<int64_t>(length, PROTOCOL_MAX_MESSAGE_SIZE);
+
+            requests.emplace_back();
+            MPI_Irecv(payload, fragmentLength, MPI_BYTE, workerNode, PROTOCOL_TAG_OUTPUT_PAYLOAD, MPI_COMM_WORLD, &requests.back());
+
+            payload += fragmentLength;
+            length -= fragmentLength;
+        }
     }
 }
+#endif
@@ -0,0 +1,115 @@
+#include "Logger.h"
+#include "Nodes.h"
+#include "OutputWriter.h"
+
+
+OutputWriter::OutputWriter(size_t windowSize) : _paragraphs(nullptr), _slots(windowSize), _nextParagraphId(0)
+{
+    for (auto& slot : _slots) {
+        slot.complete = false;
+    }
+}
+
+OutputWriter::~OutputWriter()
+{
+    if (_thread.joinable()) {
+        LOG_WARNING("Output writer destroyed before all paragraphs were written");
+        _thread.detach();
+    }
+}
+
+void OutputWriter::Start(const std::string& fileName, const std::vector<ParagraphInfo>& paragraphs, std::function<void(int)> onWritten)
+{
+    _outFile.open(fileName);
+
+    if (!_outFile) {
+        LOG_FATAL("Couldn't open file: \"{}\"", fileName);
+    }
+
+    _paragraphs = &paragraphs;
+    _onWritten = std::move(onWritten);
+    _thread = std::thread(&OutputWriter::WriterThread, this);
+}
+
+void OutputWriter::Finish()
+{
+    _thread.join();
+    _outFile.close();
+}
+
+bool OutputWriter::IsInWindow(int paragraphId) const
+{
+    return static_cast<size_t>(paragraphId - _nextParagraphId) < _slots.size();
+}
+
+void OutputWriter::WaitForWindow(int paragraphId)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _writtenCondVar.wait(lock, [this, paragraphId]() { return IsInWindow(paragraphId); });
+}
+
+void OutputWriter::AppendResult(int paragraphId, const char* payload, int length, bool last)
+{
+    Slot& slot = _slots[paragraphId % _slots.size()];
+
+    slot.text.append(payload, length);
+    if (!last) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    slot.complete = true;
+    if (paragraphId == _nextParagraphId) {
+        _completedCondVar.notify_one();
+    }
+}
+
+void OutputWriter::WriterThread()
+{
+    const std::vector<ParagraphInfo>& paragraphs = *_paragraphs;
+    int numParagraphs = paragraphs.size();
+    std::vector<std::string> readyParagraphs;
+
+    while (_nextParagraphId != numParagraphs) {
+        int firstParagraphId = _nextParagraphId;
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto isReady = [this, &paragraphs](int paragraphId) {
+                return paragraphs[paragraphId].paragraphType == Node::RANK_MASTER || _slots[paragraphId % _slots.size()].complete;
+            };
+
+            _completedCondVar.wait(lock, [&]() { return isReady(_nextParagraphId); });
+
+            // take every consecutive paragraph that is ready, their slots can be reused as soon as the window moves
+            int paragraphId = _nextParagraphId;
+            for (; paragraphId != numParagraphs && isReady(paragraphId); ++paragraphId) {
+                Slot& slot = _slots[paragraphId % _slots.size()];
+
+                readyParagraphs.emplace_back(std::move(slot.text));
+                slot.text = std::string();
+                slot.complete = false;
+            }
+
+            _nextParagraphId = paragraphId;
+            _writtenCondVar.notify_all();
+        }
+
+        // the file is written outside of the lock, the receivers keep filling the slots meanwhile
+        for (size_t i = 0; i != readyParagraphs.size(); ++i) {
+            int paragraphType = paragraphs[firstParagraphId + i].paragraphType;
+
+            _outFile << Node::GetNodeNameFromRank(paragraphType) << '\n';
+            _outFile << readyParagraphs[i];
+
+            readyParagraphs[i] = std::string();
+            if (paragraphType != Node::RANK_MASTER) {
+                _onWritten(firstParagraphId + i);
+            }
+        }
+        readyParagraphs.clear();
+    }
+
+    LOG_DEBUG("Output file written ({} paragraphs)", numParagraphs);
+}
@@ -0,0 +1,150 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+
+#include "Logger.h"
+#include "Nodes.h"
+#include "ParagraphIndex.h"
+
+#define PARAGRAPH_INDEX_MAGIC   0x58444950  // "PIDX"
+#define PARAGRAPH_INDEX_VERSION 1
+#define PARAGRAPH_INDEX_SAMPLE  4096        // bytes hashed from the start and from the end of the input file
+
+
+namespace
+{
+    struct IndexHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t fileSize;
+        int64_t mtimeSec;
+        int64_t mtimeNsec;
+        uint64_t numParagraphs;
+        uint64_t hash;
+    };
+
+    struct IndexEntry
+    {
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    // FNV-1a, 64 bit
+    uint64_t Hash(uint64_t hash, const void* data, size_t length)
+    {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+
+        for (size_t i = 0; i != length; ++i) {
+            hash ^= bytes[i];
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    uint64_t ComputeHash(const MappedFile& inFile, const std::vector<IndexEntry>& entries, const std::vector<uint8_t>& types)
+    {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        size_t sample = std::min<size_t>(inFile.GetSize(), PARAGRAPH_INDEX_SAMPLE);
+
+        hash = Hash(hash, entries.data(), entries.size() * sizeof(IndexEntry));
+        hash = Hash(hash, types.data(), types.size());
+        hash = Hash(hash, inFile.GetData(), sample);
+        hash = Hash(hash, inFile.GetData() + inFile.GetSize() - sample, sample);
+        return hash;
+    }
+}
+
+
+namespace ParagraphIndex
+{
+    bool Load(const std::string& indexFileName, const MappedFile& inFile, std::vector<ParagraphInfo>& paragraphs)
+    {
+        std::ifstream indexFile(indexFileName, std::ios::binary);
+        IndexHeader header;
+
+        if (!indexFile) {
+            LOG_DEBUG("No paragraph index found: \"{}\"", indexFileName);
+            return false;
+        }
+
+        if (!indexFile.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+            LOG_WARNING("Truncated paragraph index: \"{}\"", indexFileName);
+            return false;
+        }
+
+        const struct timespec& mtime = inFile.GetModificationTime();
+        if (header.magic != PARAGRAPH_INDEX_MAGIC || header.version != PARAGRAPH_INDEX_VERSION ||
+            header.fileSize != inFile.GetSize() || header.mtimeSec != mtime.tv_sec || header.mtimeNsec != mtime.tv_nsec ||
+            header.numParagraphs > inFile.GetSize() + 1) {
+            LOG_DEBUG("Stale paragraph index: \"{}\"", indexFileName);
+            return false;
+        }
+
+        std::vector<IndexEntry> entries(header.numParagraphs);
+        std::vector<uint8_t> types(header.numParagraphs);
+
+        indexFile.read(reinterpret_cast<char*>(entries.data()), entries.size() * sizeof(IndexEntry));
+        indexFile.read(reinterpret_cast<char*>(types.data()), types.size());
+        if (!indexFile || ComputeHash(inFile, entries, types) != header.hash) {
+            LOG_WARNING("Corrupted paragraph index: \"{}\"", indexFileName);
+            return false;
+        }
+
+        paragraphs.resize(header.numParagraphs);
+        for (size_t i = 0; i != paragraphs.size(); ++i) {
+            if (types[i] >= Node::NUM_NODE_TYPES || entries[i].offset > inFile.GetSize() || entries[i].length > inFile.GetSize() - entries[i].offset) {
+                LOG_WARNING("Invalid paragraph {} in index: \"{}\"", i, indexFileName);
+                paragraphs.clear();
+                return false;
+            }
+
+            paragraphs[i].paragraphType = types[i];
+            paragraphs[i].offset = entries[i].offset;
+            paragraphs[i].length = entries[i].length;
+        }
+
+        LOG_DEBUG("Loaded {} paragraphs from index: \"{}\"", paragraphs.size(), indexFileName);
+        return true;
+    }
+
+    bool Save(const std::string& indexFileName, const MappedFile& inFile, const std::vector<ParagraphInfo>& paragraphs)
+    {
+        std::vector<IndexEntry> entries(paragraphs.size());
+        std::vector<uint8_t> types(paragraphs.size());
+        IndexHeader header;
+
+        for (size_t i = 0; i != paragraphs.size(); ++i) {
+            entries[i].offset = paragraphs[i].offset;
+            entries[i].length = paragraphs[i].length;
+            types[i] = static_cast<uint8_t>(paragraphs[i].paragraphType);
+        }
+
+        memset(&header, 0, sizeof(header));
+        header.magic = PARAGRAPH_INDEX_MAGIC;
+        header.version = PARAGRAPH_INDEX_VERSION;
+        header.fileSize = inFile.GetSize();
+        header.mtimeSec = inFile.GetModificationTime().tv_sec;
+        header.mtimeNsec = inFile.GetModificationTime().tv_nsec;
+        header.numParagraphs = paragraphs.size();
+        header.hash = ComputeHash(inFile, entries, types);
+
+        std::ofstream indexFile(indexFileName, std::ios::binary | std::ios::trunc);
+        if (!indexFile) {
+            LOG_WARNING("Couldn't create paragraph index: \"{}\"", indexFileName);
+            return false;
+        }
+
+        indexFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        indexFile.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(IndexEntry));
+        indexFile.write(reinterpret_cast<const char*>(types.data()), types.size());
+        if (!indexFile) {
+            LOG_WARNING("Couldn't write paragraph index: \"{}\"", indexFileName);
+            return false;
+        }
+
+        LOG_DEBUG("Saved {} paragraphs to index: \"{}\"", paragraphs.size(), indexFileName);
+        return true;
+    }
+}
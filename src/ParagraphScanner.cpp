@@ -0,0 +1,132 @@
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <thread>
+
+#include "Kernels.h"
+#include "Logger.h"
+#include "Nodes.h"
+#include "ParagraphScanner.h"
+
+
+ParagraphScanner::ParagraphScanner(const char* data, size_t size) : _data(data), _size(size)
+{
+    for (int rank = Node::RANK_WORKER_HORROR; rank != Node::NUM_NODE_TYPES; ++rank) {
+        _paragraphNames[rank] = Node::GetNodeNameFromRank(rank);
+    }
+}
+
+void ParagraphScanner::Scan(std::vector<ParagraphInfo>& paragraphs, unsigned int numThreads)
+{
+    if (numThreads == 0) {
+        numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    size_t numChunks = std::min<size_t>(numThreads, std::max<size_t>(_size / SCANNER_MIN_CHUNK_SIZE, 1));
+    std::vector<size_t> chunkStarts(numChunks + 1);
+    std::vector<std::vector<ParagraphInfo>> chunkParagraphs(numChunks);
+    std::vector<std::thread> threads;
+
+    // a chunk may only start right after a non-empty line: there the parser is known to be inside a paragraph,
+    // so every chunk can be scanned on its own, without knowing what happened before it
+    chunkStarts[0] = 0;
+    chunkStarts[numChunks] = _size;
+    for (size_t i = 1; i != numChunks; ++i) {
+        chunkStarts[i] = std::max(FindChunkStart(_size / numChunks * i), chunkStarts[i - 1]);
+    }
+
+    for (size_t i = 1; i < numChunks; ++i) {
+        threads.emplace_back(&ParagraphScanner::ScanChunk, this, chunkStarts[i], chunkStarts[i + 1], true, std::ref(chunkParagraphs[i]));
+    }
+    ScanChunk(chunkStarts[0], chunkStarts[1], false, chunkParagraphs[0]);
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    // global paragraph IDs: prefix sum over the number of paragraphs found in every chunk
+    std::vector<size_t> firstParagraphIdx(numChunks + 1, 0);
+    for (size_t i = 0; i != numChunks; ++i) {
+        firstParagraphIdx[i + 1] = firstParagraphIdx[i] + chunkParagraphs[i].size();
+    }
+
+    paragraphs.resize(firstParagraphIdx[numChunks]);
+    for (size_t i = 0; i != numChunks; ++i) {
+        std::copy(chunkParagraphs[i].begin(), chunkParagraphs[i].end(), paragraphs.begin() + firstParagraphIdx[i]);
+    }
+
+    if (!paragraphs.empty() && paragraphs.back().offset + paragraphs.back().length == _size) {
+        LOG_DEBUG("Invalid input file ending. Make sure it ends with an empty line.");
+    }
+
+    LOG_DEBUG("Scanned {} paragraphs ({} bytes, {} chunks)", paragraphs.size(), _size, numChunks);
+}
+
+// Collects the paragraphs whose header starts in [start, end); the body of the last one may extend past `end`
+void ParagraphScanner::ScanChunk(size_t start, size_t end, bool insideParagraph, std::vector<ParagraphInfo>& paragraphs) const
+{
+    size_t pos = start;
+
+    if (insideParagraph) {
+        // the paragraph that is cut by the chunk start belongs to the previous chunk, skip it
+        pos = FindEmptyLine(start) + 1;
+    }
+
+    // every iteration starts on a header line: every header starts a new paragraph,
+    // even if it doesn't belong to any worker or it's empty (it still consumes an ID)
+    while (pos < end) {
+        size_t headerEnd = FindLineEnd(pos);
+        size_t bodyStart = std::min(headerEnd + 1, _size);
+        size_t bodyEnd = FindEmptyLine(bodyStart);
+
+        int paragraphType = GetParagraphTypeFromHeader(_data + pos, headerEnd - pos);
+        paragraphs.push_back({ paragraphType, bodyStart, bodyEnd - bodyStart });
+
+        // skip the empty line that ended the paragraph, the next line is a header
+        pos = bodyEnd + 1;
+    }
+}
+
+// Returns the start of the first line at or after `pos` that follows a non-empty line (or the file size)
+size_t ParagraphScanner::FindChunkStart(size_t pos) const
+{
+    for (pos = std::max<size_t>(pos, 1); pos < _size; ++pos) {
+        pos = FindLineEnd(pos);
+        if (pos < _size && _data[pos - 1] != '\n') {
+            return pos + 1;
+        }
+    }
+    return _size;
+}
+
+int ParagraphScanner::GetParagraphTypeFromHeader(const char* header, size_t length) const
+{
+    for (int rank = Node::RANK_WORKER_HORROR; rank != Node::NUM_NODE_TYPES; ++rank) {
+        const std::string& name = _paragraphNames[rank];
+        if (name.length() == length && memcmp(name.c_str(), header, length) == 0) {
+            return rank;
+        }
+    }
+
+    // unknown headers are never sent to a worker; the output file has always shown them as "master" paragraphs
+    return Node::RANK_MASTER;
+}
+
+// Returns the position of the '\n' that ends the line starting at `pos` (or the file size for the last line)
+size_t ParagraphScanner::FindLineEnd(size_t pos) const
+{
+    const char* newLine = static_cast<const char*>(memchr(_data + pos, '\n', _size - pos));
+    return newLine ? newLine - _data : _size;
+}
+
+// Returns the start of the first empty line found at or after `pos` (which must be the start of a line)
+// Only the "\n\n" pairs matter here, so the lines in between are skipped without being split
+size_t ParagraphScanner::FindEmptyLine(size_t pos) const
+{
+    if (pos >= _size || _data[pos] == '\n') {
+        return pos;
+    }
+
+    // the '\n' before `pos` can't be part of a pair (the byte at `pos` isn't one), so the search starts right at `pos`
+    return std::min(Kernels::FindDoubleNewLine(_data, pos, _size) + 1, _size);
+}
@@ -0,0 +1,84 @@
+#include "Logger.h"
+#include "Nodes.h"
+#include "ParallelOutputFile.h"
+
+
+ParallelOutputFile::ParallelOutputFile() : _file(MPI_FILE_NULL)
+{
+
+}
+
+ParallelOutputFile::~ParallelOutputFile()
+{
+    if (_file != MPI_FILE_NULL) {
+        LOG_WARNING("Output file \"{}\" was never closed", _fileName);
+    }
+}
+
+void ParallelOutputFile::Open(const std::string& fileName)
+{
+    int rank, fileNameLength;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    // only the Master knows the name of the input file
+    _fileName = (rank == Node::RANK_MASTER) ? fileName : std::string();
+    fileNameLength = _fileName.length();
+
+    MPI_Bcast(&fileNameLength, 1, MPI_INT, Node::RANK_MASTER, MPI_COMM_WORLD);
+    _fileName.resize(fileNameLength);
+    MPI_Bcast(&_fileName[0], fileNameLength, MPI_CHAR, Node::RANK_MASTER, MPI_COMM_WORLD);
+
+    if (MPI_File_open(MPI_COMM_WORLD, _fileName.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &_file) != MPI_SUCCESS) {
+        LOG_FATAL("Couldn't open file: \"{}\"", _fileName);
+    }
+
+    if (MPI_File_set_size(_file, 0) != MPI_SUCCESS) {
+        LOG_FATAL("Couldn't truncate file: \"{}\"", _fileName);
+    }
+}
+
+void ParallelOutputFile::Close()
+{
+    MPI_File_close(&_file);
+}
+
+void ParallelOutputFile::WriteBlocks(const std::vector<OutputBlock>& blocks)
+{
+    int numBlocks = blocks.size();
+    int result;
+
+    if (numBlocks == 0) {
+        // the write is collective, the ranks with nothing to write still have to take part in it
+        MPI_File_set_view(_file, 0, MPI_BYTE, MPI_BYTE, "native", MPI_INFO_NULL);
+        result = MPI_File_write_all(_file, nullptr, 0, MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+    else {
+        // the file type selects the blocks' ranges of the file, the memory type gathers their data from wherever it is
+        std::vector<int> blockLengths(numBlocks);
+        std::vector<MPI_Aint> fileDisplacements(numBlocks);
+        std::vector<MPI_Aint> memoryDisplacements(numBlocks);
+        MPI_Datatype fileType, memoryType;
+
+        for (int i = 0; i != numBlocks; ++i) {
+            blockLengths[i] = blocks[i].length;
+            fileDisplacements[i] = blocks[i].offset;
+            MPI_Get_address(blocks[i].data, &memoryDisplacements[i]);
+        }
+
+        MPI_Type_create_hindexed(numBlocks, blockLengths.data(), fileDisplacements.data(), MPI_BYTE, &fileType);
+        MPI_Type_commit(&fileType);
+        MPI_Type_create_hindexed(numBlocks, blockLengths.data(), memoryDisplacements.data(), MPI_BYTE, &memoryType);
+        MPI_Type_commit(&memoryType);
+
+        MPI_File_set_view(_file, 0, MPI_BYTE, fileType, "native", MPI_INFO_NULL);
+        result = MPI_File_write_all(_file, MPI_BOTTOM, 1, memoryType, MPI_STATUS_IGNORE);
+
+        MPI_Type_free(&memoryType);
+        MPI_Type_free(&fileType);
+    }
+
+    if (result != MPI_SUCCESS) {
+        LOG_FATAL("Couldn't write {} blocks to file: \"{}\"", numBlocks, _fileName);
+    }
+}
@@ -0,0 +1,427 @@
+#include <mpi.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "Logger.h"
+#include "Protocol.h"
+
+
+namespace
+{
+    // Starts the send of a buffer, or of a frame header glued to a payload that is sent in place
+    void StartSend(int destRank, const void* buffer, int length, const char* payload, int payloadLength, MPI_Request* request)
+    {
+        if (!payload) {
+            MPI_Isend(buffer, length, MPI_BYTE, destRank, PROTOCOL_TAG_PARAGRAPH, MPI_COMM_WORLD, request);
+            return;
+        }
+
+        // header and payload are glued together by the MPI library, the payload is never copied by us
+        int blockLengths[2] = { length, payloadLength };
+        MPI_Aint displacements[2];
+        MPI_Datatype frameType;
+
+        MPI_Get_address(buffer, &displacements[0]);
+        MPI_Get_address(payload, &displacements[1]);
+        MPI_Type_create_hindexed(2, blockLengths, displacements, MPI_BYTE, &frameType);
+        MPI_Type_commit(&frameType);
+
+        MPI_Isend(MPI_BOTTOM, 1, frameType, destRank, PROTOCOL_TAG_PARAGRAPH, MPI_COMM_WORLD, request);
+
+        // the datatype is only released after the pending send completes
+        MPI_Type_free(&frameType);
+    }
+}
+
+
+namespace Protocol
+{
+    CreditGate::CreditGate() : _granted(false), _grant({ 0, 0 }), _outstandingBytes(0), _outstandingParagraphs(0)
+    {
+
+    }
+
+    void CreditGate::Grant(const CreditGrant& grant)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        if (grant.maxBytes <= 0 || grant.maxParagraphs <= 0) {
+            LOG_FATAL("Invalid credit grant (bytes: {}, paragraphs: {})", grant.maxBytes, grant.maxParagraphs);
+        }
+
+        _granted = true;
+        _grant = grant;
+        _condVar.notify_all();
+    }
+
+    bool CreditGate::TryAcquire(size_t bytes)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        if (!CanAcquire(bytes)) {
+            return false;
+        }
+
+        _outstandingBytes += bytes;
+        _outstandingParagraphs++;
+        return true;
+    }
+
+    void CreditGate::Acquire(size_t bytes)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _condVar.wait(lock, [this, bytes]() { return CanAcquire(bytes); });
+
+        _outstandingBytes += bytes;
+        _outstandingParagraphs++;
+    }
+
+    void CreditGate::Release(size_t bytes)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        _outstandingBytes -= bytes;
+        _outstandingParagraphs--;
+        _condVar.notify_all();
+    }
+
+    bool CreditGate::CanAcquire(size_t bytes) const
+    {
+        if (!_granted) {
+            return false;
+        }
+        if (_outstandingParagraphs == 0) {
+            return true;
+        }
+
+        return _outstandingParagraphs < static_cast<size_t>(_grant.maxParagraphs) &&
+               _outstandingBytes + bytes <= static_cast<size_t>(_grant.maxBytes);
+    }
+
+
+    SendQueue::SendQueue()
+    {
+
+    }
+
+    void SendQueue::Push(int destRank, const void* buffer, int length, const char* payload, int payloadLength, bool* pending)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        *pending = true;
+        _queuedSends.push_back({ destRank, buffer, length, payload, payloadLength, pending });
+        _pushedCondVar.notify_one();
+    }
+
+    void SendQueue::WaitForCompletion(const bool* pending)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _completedCondVar.wait(lock, [pending]() { return !*pending; });
+    }
+
+    bool SendQueue::Progress()
+    {
+        std::deque<QueuedSend> queuedSends;
+        bool progress;
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            queuedSends.swap(_queuedSends);
+        }
+
+        for (auto& send : queuedSends) {
+            _requests.emplace_back();
+            _pendingFlags.push_back(send.pending);
+            StartSend(send.destRank, send.buffer, send.length, send.payload, send.payloadLength, &_requests.back());
+        }
+        progress = !queuedSends.empty();
+
+        if (_requests.empty()) {
+            return progress;
+        }
+
+        std::vector<int> completed(_requests.size());
+        int numCompleted;
+
+        MPI_Testsome(_requests.size(), _requests.data(), &numCompleted, completed.data(), MPI_STATUSES_IGNORE);
+        if (numCompleted <= 0) {
+            return progress;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+
+            for (int i = 0; i != numCompleted; ++i) {
+                *_pendingFlags[completed[i]] = false;
+            }
+            _completedCondVar.notify_all();
+        }
+
+        // drop the completed requests (MPI_Testsome has set them to MPI_REQUEST_NULL)
+        size_t numRequests = 0;
+        for (size_t i = 0; i != _requests.size(); ++i) {
+            if (_requests[i] != MPI_REQUEST_NULL) {
+                _requests[numRequests] = _requests[i];
+                _pendingFlags[numRequests] = _pendingFlags[i];
+                numRequests++;
+            }
+        }
+        _requests.resize(numRequests);
+        _pendingFlags.resize(numRequests);
+
+        return true;
+    }
+
+    bool SendQueue::IsDrained()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _queuedSends.empty() && _requests.empty();
+    }
+
+    void SendQueue::WaitForMessages(int timeoutUs)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _pushedCondVar.wait_for(lock, std::chrono::microseconds(timeoutUs), [this]() { return !_queuedSends.empty(); });
+    }
+
+
+    EnvelopeWriter::EnvelopeWriter(int destRank, size_t maxSize, int maxFrames) :
+        EnvelopeWriter(destRank, nullptr, maxSize, maxFrames)
+    {
+
+    }
+
+    EnvelopeWriter::EnvelopeWriter(int destRank, SendQueue* sendQueue, size_t maxSize, int maxFrames) :
+        _destRank(destRank), _sendQueue(sendQueue), _maxSize(std::min<size_t>(maxSize, PROTOCOL_MAX_MESSAGE_SIZE)), _maxFrames(maxFrames),
+        _slots(PROTOCOL_SEND_RING_SIZE), _requests(PROTOCOL_SEND_RING_SIZE, MPI_REQUEST_NULL), _currentSlot(0), _numFrames(0)
+    {
+        for (auto& slot : _slots) {
+            slot.envelope.reserve(_maxSize);
+            slot.pending = false;
+        }
+    }
+
+    EnvelopeWriter::~EnvelopeWriter()
+    {
+        if (_numFrames) {
+            LOG_WARNING("Envelope for rank {} destroyed with {} unsent frames", _destRank, _numFrames);
+        }
+
+        // the buffers in flight belong to this object
+        WaitForSends();
+    }
+
+    void EnvelopeWriter::Append(int paragraphId, const char* payload, int length, int flags)
+    {
+        FrameHeader header = { paragraphId, length, flags };
+        size_t frameSize = sizeof(header) + length;
+
+        if (length > PROTOCOL_COPY_THRESHOLD) {
+            SendInPlace(paragraphId, payload, length, flags, nullptr);
+            return;
+        }
+
+        if (_numFrames && (_slots[_currentSlot].envelope.size() + frameSize > _maxSize || _numFrames == _maxFrames)) {
+            Flush();
+        }
+
+        SendSlot& slot = (_numFrames == 0) ? AcquireCurrentSlot() : _slots[_currentSlot];
+        size_t position = slot.envelope.size();
+
+        slot.envelope.resize(position + frameSize);
+        memcpy(&slot.envelope[position], &header, sizeof(header));
+        if (length) {
+            memcpy(&slot.envelope[position + sizeof(header)], payload, length);
+        }
+        _numFrames++;
+    }
+
+    void EnvelopeWriter::AppendOwned(int paragraphId, std::string&& payload)
+    {
+        if (payload.length() > PROTOCOL_COPY_THRESHOLD) {
+            auto ownedPayload = std::make_shared<const std::string>(std::move(payload));
+            SendInPlace(paragraphId, ownedPayload->c_str(), ownedPayload->length(), FRAME_FLAG_NONE, ownedPayload);
+            return;
+        }
+
+        Append(paragraphId, payload.c_str(), payload.length());
+    }
+
+    void EnvelopeWriter::Flush()
+    {
+        if (_numFrames == 0) {
+            return;
+        }
+
+        std::vector<char>& envelope = _slots[_currentSlot].envelope;
+        SendCurrentSlot(envelope.data(), envelope.size(), nullptr, 0);
+        _numFrames = 0;
+    }
+
+    void EnvelopeWriter::Finish()
+    {
+        Append(-1, nullptr, 0, FRAME_FLAG_FINISH);
+        Flush();
+        WaitForSends();
+    }
+
+    // Returns the slot that will be filled next, waiting for its previous send to complete if needed
+    EnvelopeWriter::SendSlot& EnvelopeWriter::AcquireCurrentSlot()
+    {
+        SendSlot& slot = _slots[_currentSlot];
+
+        if (_sendQueue) {
+            _sendQueue->WaitForCompletion(&slot.pending);
+        }
+        else if (_requests[_currentSlot] != MPI_REQUEST_NULL) {
+            MPI_Wait(&_requests[_currentSlot], MPI_STATUS_IGNORE);
+        }
+
+        slot.envelope.clear();
+        slot.ownedPayload.reset();
+        return slot;
+    }
+
+    void EnvelopeWriter::SendCurrentSlot(const void* buffer, int length, const char* payload, int payloadLength)
+    {
+        SendSlot& slot = _slots[_currentSlot];
+        size_t slotIdx = _currentSlot;
+
+        _currentSlot = (_currentSlot + 1) % _slots.size();
+
+        if (_sendQueue) {
+            _sendQueue->Push(_destRank, buffer, length, payload, payloadLength, &slot.pending);
+            return;
+        }
+
+        int completed;
+        StartSend(_destRank, buffer, length, payload, payloadLength, &_requests[slotIdx]);
+
+        // give the MPI library a chance to progress the envelopes that are still on the wire
+        MPI_Testall(_requests.size(), _requests.data(), &completed, MPI_STATUSES_IGNORE);
+    }
+
+    void EnvelopeWriter::SendInPlace(int paragraphId, const char* payload, int length, int flags, const std::shared_ptr<const std::string>& ownedPayload)
+    {
+        const int maxFragmentLength = PROTOCOL_MAX_MESSAGE_SIZE - sizeof(FrameHeader);
+
+        // keep the frames in order: whatever is buffered must leave first
+        Flush();
+
+        do {
+            int fragmentLength = std::min(length, maxFragmentLength);
+            int fragmentFlags = (fragmentLength < length) ? (flags | FRAME_FLAG_MORE) : flags;
+
+            SendSlot& slot = AcquireCurrentSlot();
+            slot.header = { paragraphId, fragmentLength, fragmentFlags };
+            slot.ownedPayload = ownedPayload;
+
+            SendCurrentSlot(&slot.header, sizeof(FrameHeader), payload, fragmentLength);
+
+            payload += fragmentLength;
+            length -= fragmentLength;
+        } while (length > 0);
+    }
+
+    void EnvelopeWriter::WaitForSends()
+    {
+        if (_sendQueue) {
+            for (auto& slot : _slots) {
+                _sendQueue->WaitForCompletion(&slot.pending);
+            }
+            return;
+        }
+
+        MPI_Waitall(_requests.size(), _requests.data(), MPI_STATUSES_IGNORE);
+    }
+
+
+    EnvelopeReader::EnvelopeReader() : _sourceRank(-1), _envelopeLength(0), _position(0)
+    {
+
+    }
+
+    void EnvelopeReader::Receive(int sourceRank)
+    {
+        MPI_Status status;
+
+        MPI_Probe(sourceRank, PROTOCOL_TAG_PARAGRAPH, MPI_COMM_WORLD, &status);
+        ReceiveProbed(status);
+    }
+
+    bool EnvelopeReader::TryReceive(int sourceRank)
+    {
+        MPI_Status status;
+        int available;
+
+        MPI_Iprobe(sourceRank, PROTOCOL_TAG_PARAGRAPH, MPI_COMM_WORLD, &available, &status);
+        if (!available) {
+            return false;
+        }
+
+        ReceiveProbed(status);
+        return true;
+    }
+
+    void EnvelopeReader::PostReceive(int sourceRank, MPI_Request& request)
+    {
+        // allocated (and zero-filled) once, the received length is kept apart
+        if (_envelope.size() < PROTOCOL_MAX_MESSAGE_SIZE) {
+            _envelope.resize(PROTOCOL_MAX_MESSAGE_SIZE);
+        }
+        _envelopeLength = 0;
+        _position = 0;
+
+        MPI_Irecv(_envelope.data(), PROTOCOL_MAX_MESSAGE_SIZE, MPI_BYTE, sourceRank, PROTOCOL_TAG_PARAGRAPH, MPI_COMM_WORLD, &request);
+    }
+
+    void EnvelopeReader::CompleteReceive(const MPI_Status& status)
+    {
+        int envelopeLength;
+
+        MPI_Get_count(&status, MPI_BYTE, &envelopeLength);
+
+        _envelopeLength = envelopeLength;
+        _sourceRank = status.MPI_SOURCE;
+        _position = 0;
+    }
+
+    void EnvelopeReader::ReceiveProbed(const MPI_Status& status)
+    {
+        int envelopeLength;
+
+        MPI_Get_count(&status, MPI_BYTE, &envelopeLength);
+
+        if (_envelope.size() < static_cast<size_t>(envelopeLength)) {
+            _envelope.resize(envelopeLength);
+        }
+        _envelopeLength = envelopeLength;
+        MPI_Recv(_envelope.data(), envelopeLength, MPI_BYTE, status.MPI_SOURCE, PROTOCOL_TAG_PARAGRAPH, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+        _sourceRank = status.MPI_SOURCE;
+        _position = 0;
+    }
+
+    bool EnvelopeReader::NextFrame(FrameHeader& header, const char*& payload)
+    {
+        if (_position == _envelopeLength) {
+            return false;
+        }
+
+        if (_envelopeLength - _position < sizeof(header)) {
+            LOG_FATAL("Truncated frame header received from rank {}", _sourceRank);
+        }
+
+        memcpy(&header, &_envelope[_position], sizeof(header));
+        _position += sizeof(header);
+
+        if (header.length < 0 || _envelopeLength - _position < static_cast<size_t>(header.length)) {
+            LOG_FATAL("Invalid frame length received from rank {} (header: {}, left in envelope: {})", _sourceRank, header.length, _envelopeLength - _position);
+        }
+
+        payload = _envelope.data() + _position;
+        _position += header.length;
+        return true;
+    }
+}
@@ -1,12 +1,14 @@
 #include "SimpleThreadPool.h"
 
+static_assert((THREAD_POOL_QUEUE_SIZE & (THREAD_POOL_QUEUE_SIZE - 1)) == 0, "THREAD_POOL_QUEUE_SIZE must be a power of 2");
 
-SimpleThreadPool::SimpleThreadPool() : _shutDown(true)
+
+SimpleThreadPool::SimpleThreadPool() : _enqueuePos(0), _dequeuePos(0), _pendingJobs(0), _numParked(0), _numFullWaiters(0), _shutDown(true)
 {
 
 }
 
-SimpleThreadPool::SimpleThreadPool(int numOfThreads) : _shutDown(true)
+SimpleThreadPool::SimpleThreadPool(int numOfThreads) : _enqueuePos(0), _dequeuePos(0), _pendingJobs(0), _numParked(0), _numFullWaiters(0), _shutDown(true)
 {
     Start(numOfThreads);
 }
@@ -22,6 +24,13 @@ bool SimpleThreadPool::Start(int numOfThreads)
         return false;
     }
 
+    if (!_slots) {
+        _slots.reset(new Slot[THREAD_POOL_QUEUE_SIZE]);
+        for (size_t i = 0; i != THREAD_POOL_QUEUE_SIZE; ++i) {
+            _slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
     _threads.resize(numOfThreads);
     _shutDown = false;
 
@@ -38,42 +47,60 @@ bool SimpleThreadPool::ShutDown()
         return false;
     }
 
-    _shutDown = true;
+    {
+        std::lock_guard<std::mutex> lock(_parkMutex);
+        _shutDown = true;
+    }
     _queueCondVar.notify_all();
 
     for (auto& thread : _threads) {
         thread.join();
     }
 
-    while (!_queueJobs.empty()) {
-        _queueJobs.pop();
+    // the jobs that never started are dropped
+    std::function<void()> job;
+    while (TryPop(job)) {
+        _pendingJobs--;
     }
 
     return true;
 }
 
-bool SimpleThreadPool::AddJob(std::function<void()> func) 
+bool SimpleThreadPool::AddJob(std::function<void()> func)
 {
-    std::unique_lock<std::mutex> lock(_queueMutex);
-
     if (_shutDown) {
         return false;
     }
 
-    _queueJobs.push(func);
-    _queueCondVar.notify_one();
+    _pendingJobs++;
+    while (!TryPush(func)) {
+        // the same handshake as in Park, the other way around: a thread that frees a slot after this increment sees it
+        std::unique_lock<std::mutex> lock(_parkMutex);
+
+        _numFullWaiters++;
+        _freeSlotCondVar.wait(lock, [this]() { return HasFreeSlot(); });
+        _numFullWaiters--;
+    }
+
+    // a thread that parks after this check sees the job before it goes to sleep (publishing the job and this check are
+    // both sequentially consistent, so at least one of the two sides notices the other)
+    if (_numParked.load() != 0) {
+        std::lock_guard<std::mutex> lock(_parkMutex);
+        _queueCondVar.notify_one();
+    }
     return true;
 }
 
 void SimpleThreadPool::WaitForJobsToComplete()
 {
-    std::unique_lock<std::mutex> lock(_queueMutex);
+    std::unique_lock<std::mutex> lock(_parkMutex);
 
     if (_shutDown) {
         return;
     }
 
-    _finishJobsCondVar.wait(lock, [this]() { return _queueJobs.empty(); });
+    // the running jobs count too: a job is complete when it returned, not when it left the queue
+    _finishJobsCondVar.wait(lock, [this]() { return _pendingJobs.load() == 0; });
 
     // * It doesn't make sense to wait on _shutDown == 1 here because ShutDown()/Destructor can only be called from the main thread (convention)
     // * WaitForJobsToComplete is a blocking function that runs on the main thread
@@ -82,22 +109,117 @@ void SimpleThreadPool::WaitForJobsToComplete()
 
 void SimpleThreadPool::Executor()
 {
+    int spins = 0;
+
     while (!_shutDown) {
         std::function<void()> func;
 
-        {
-            std::unique_lock<std::mutex> lock(_queueMutex);
-            _queueCondVar.wait(lock, [this]() { return _shutDown || !_queueJobs.empty(); });
-
-            if (_shutDown) {
-                break;
+        if (!TryPop(func)) {
+            if (++spins < THREAD_POOL_SPIN_COUNT) {
+                std::this_thread::yield();
+            }
+            else {
+                spins = 0;
+                Park();
             }
+            continue;
+        }
 
-            func = _queueJobs.front();
-            _queueJobs.pop();
+        spins = 0;
+        if (_numFullWaiters.load() != 0) {
+            std::lock_guard<std::mutex> lock(_parkMutex);
+            _freeSlotCondVar.notify_one();
         }
 
         func();
-        _finishJobsCondVar.notify_one();
+
+        if (--_pendingJobs == 0) {
+            std::lock_guard<std::mutex> lock(_parkMutex);
+            _finishJobsCondVar.notify_all();
+        }
     }
 }
+
+// Sleeps until a job is added or the pool is shut down
+void SimpleThreadPool::Park()
+{
+    std::unique_lock<std::mutex> lock(_parkMutex);
+
+    _numParked++;
+    _queueCondVar.wait(lock, [this]() { return _shutDown || HasReadyJob(); });
+    _numParked--;
+}
+
+// Vyukov's bounded MPMC queue: a producer claims a position with a CAS on `_enqueuePos`, then publishes the job through
+// the slot's sequence number. Returns false if the queue is full (`job` is left untouched)
+bool SimpleThreadPool::TryPush(std::function<void()>& job)
+{
+    size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+    Slot* slot;
+
+    for (;;) {
+        slot = &_slots[pos & (THREAD_POOL_QUEUE_SIZE - 1)];
+        intptr_t diff = static_cast<intptr_t>(slot->sequence.load(std::memory_order_acquire)) - static_cast<intptr_t>(pos);
+
+        if (diff == 0) {
+            if (_enqueuePos.compare_exchange_weak(pos, pos + 1)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            // the slot still holds the job of the previous lap
+            return false;
+        }
+        else {
+            pos = _enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->job = std::move(job);
+    slot->sequence.store(pos + 1);
+    return true;
+}
+
+// Returns false if there is no job ready to be taken
+bool SimpleThreadPool::TryPop(std::function<void()>& job)
+{
+    size_t pos = _dequeuePos.load(std::memory_order_relaxed);
+    Slot* slot;
+
+    for (;;) {
+        slot = &_slots[pos & (THREAD_POOL_QUEUE_SIZE - 1)];
+        intptr_t diff = static_cast<intptr_t>(slot->sequence.load(std::memory_order_acquire)) - static_cast<intptr_t>(pos + 1);
+
+        if (diff == 0) {
+            if (_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            return false;
+        }
+        else {
+            pos = _dequeuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    job = std::move(slot->job);
+    slot->job = nullptr;
+    slot->sequence.store(pos + THREAD_POOL_QUEUE_SIZE);
+    return true;
+}
+
+// Whether the job at the head of the queue is published (a position may be claimed long before its job is stored, if
+// the producer gets preempted: an idle thread that only compared the positions would spin until then)
+bool SimpleThreadPool::HasReadyJob() const
+{
+    size_t pos = _dequeuePos.load();
+    return _slots[pos & (THREAD_POOL_QUEUE_SIZE - 1)].sequence.load() == pos + 1;
+}
+
+// Whether the slot at the tail of the queue is free (only the owner adds jobs, so the position can't move meanwhile)
+bool SimpleThreadPool::HasFreeSlot() const
+{
+    size_t pos = _enqueuePos.load();
+    return _slots[pos & (THREAD_POOL_QUEUE_SIZE - 1)].sequence.load() == pos;
+}
@@ -1,11 +1,14 @@
 #include <mpi.h>
-#include <thread>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iterator>
 #include <vector>
 #include <unistd.h>
 
 #include "Logger.h"
+#include "Protocol.h"
 #include "Worker.h"
-#include "Utils.h"
 
 
 Worker::Worker()
@@ -27,172 +30,248 @@ void Worker::Start()
         LOG_FATAL("Expected at least 2 CPU cores, found: {}", _availableCores);
     }
 
-    std::thread(&Worker::CommThread, this).join();
+#ifdef OUTPUT_MPI_IO
+    // the output file is opened by all the ranks at once, before the Master sends any paragraph
+    _outputFile.Open(std::string());
+#endif
+
+    // every MPI call is made by the comm thread, so it runs right on the main thread (MPI_THREAD_FUNNELED is enough)
+    CommThread();
+
+#if defined(OUTPUT_MPI_IO)
+    WriteOutputParagraphs();
+#elif defined(OUTPUT_MMAP)
+    SendOutputParagraphs();
+#endif
 }
 
 void Worker::CommThread()
 {
     LOG_DEBUG("Comm thread started");
 
-    CommReceive();
-    CommSend();
+    Protocol::EnvelopeReader reader;
+    Protocol::EnvelopeWriter writer(RANK_MASTER);
+    bool receiving = true;
 
-    LOG_DEBUG("Comm thread ended");
-}
+    _threadPool.Start(_availableCores - 1);
 
-void Worker::CommReceive()
-{
-    LOG_DEBUG("Process incoming messages");
+    // the Master won't send anything until it knows how much the worker is willing to queue
+    Protocol::CreditGrant grant = { WORKER_CREDIT_BYTES, WORKER_CREDIT_PARAGRAPHS };
+    writer.Append(-1, reinterpret_cast<const char*>(&grant), sizeof(grant), Protocol::FRAME_FLAG_GRANT);
+    writer.Flush();
 
-    MPI_Status status;
-    int commandOrParagraphId;
+    // receiving new paragraphs and sending back the processed ones are interleaved,
+    // so a paragraph leaves the worker as soon as all of its jobs are done
+    while (receiving || !_paragraphsList.empty()) {
+        bool progress = CommSend(writer);
 
-    _threadPool.Start(_availableCores - 1);
-
-    while (1) {
-        MPI_Recv(&commandOrParagraphId, 1, MPI_INT, RANK_MASTER, 0, MPI_COMM_WORLD, &status);
-        if (commandOrParagraphId < 0) {
-            // FINISH command
-            break;
+        if (receiving) {
+            bool finished = false;
+            progress |= CommReceive(reader, finished);
+            receiving = !finished;
         }
 
-        ReceiveParagraph(commandOrParagraphId);
-        ProcessLastParagraph();
+        if (!progress) {
+            WaitForProcessedParagraphs(receiving);
+        }
     }
 
-    _threadPool.WaitForJobsToComplete();
+    writer.Finish();
+
     _threadPool.ShutDown();
+
+    LOG_DEBUG("Comm thread ended");
 }
 
-void Worker::CommSend()
+// Processes the next envelope from the Master, if there is one. Returns false if nothing was received
+bool Worker::CommReceive(Protocol::EnvelopeReader& reader, bool& finished)
 {
-    LOG_DEBUG("Process outgoing messages");
+    Protocol::FrameHeader header;
+    const char* payload;
 
-    std::string fullParagraph;
-    int paragraphLength;
-
-    for (auto& paragraph : _paragraphsList) {
-        MPI_Send(&paragraph.globalIdx, 1, MPI_INT, RANK_MASTER, 0, MPI_COMM_WORLD);
+    if (!reader.TryReceive(RANK_MASTER)) {
+        return false;
+    }
 
-        for (auto& line : paragraph.lines) {
-            fullParagraph += line + '\n';
+    while (reader.NextFrame(header, payload)) {
+        if (header.flags & Protocol::FRAME_FLAG_FINISH) {
+            LOG_DEBUG("All paragraphs received");
+            finished = true;
+            break;
         }
 
-        paragraphLength = fullParagraph.length();
-        MPI_Send(&paragraphLength, 1, MPI_INT, RANK_MASTER, 0, MPI_COMM_WORLD);
-        MPI_Send(fullParagraph.c_str(), paragraphLength, MPI_CHAR, RANK_MASTER, 0, MPI_COMM_WORLD);
+        if (header.flags & Protocol::FRAME_FLAG_MORE) {
+            _partialParagraph.append(payload, header.length);
+            continue;
+        }
 
-        fullParagraph.clear();
+        if (!_partialParagraph.empty()) {
+            // last fragment of a large paragraph
+            _partialParagraph.append(payload, header.length);
+            ReceiveParagraph(header.paragraphId, _partialParagraph.c_str(), _partialParagraph.length());
+            _partialParagraph.clear();
+        }
+        else {
+            ReceiveParagraph(header.paragraphId, payload, header.length);
+        }
+        ProcessLastParagraph();
     }
 
-    paragraphLength = -1;
-    MPI_Send(&paragraphLength, 1, MPI_INT, RANK_MASTER, 0, MPI_COMM_WORLD);
+    return true;
 }
 
-void Worker::ReceiveParagraph(int globalParagraphIdx)
+// Sends back every paragraph that was completely processed. Returns true if there was any
+bool Worker::CommSend(Protocol::EnvelopeWriter& writer)
 {
-    MPI_Status status;
-    Worker::Paragraph paragraph;
-    std::string fullParagraph;
-    int paragraphLength;
-
-    paragraph.globalIdx = globalParagraphIdx;
+    std::vector<std::list<Worker::Paragraph>::iterator> processedParagraphs;
 
-    MPI_Recv(&paragraphLength, 1, MPI_INT, RANK_MASTER, 0, MPI_COMM_WORLD, &status);
+    {
+        std::unique_lock<std::mutex> lock(_processedMutex);
+        processedParagraphs.swap(_processedParagraphs);
+    }
 
-    fullParagraph.resize(paragraphLength);
-    MPI_Recv(&fullParagraph[0], paragraphLength, MPI_CHAR, RANK_MASTER, 0, MPI_COMM_WORLD, &status);
+    for (auto paragraph : processedParagraphs) {
+        std::string& fullParagraph = paragraph->output;
+
+#ifdef PROTOCOL_SIZE_FRAMES
+        // only the size goes back to the Master for now, the text follows once the Master knows all the sizes
+        int64_t size = fullParagraph.length();
+        writer.Append(paragraph->globalIdx, reinterpret_cast<const char*>(&size), sizeof(size), Protocol::FRAME_FLAG_SIZE);
+        _outputParagraphs.emplace_back(paragraph->globalIdx, std::move(fullParagraph));
+#else
+        writer.AppendOwned(paragraph->globalIdx, std::move(fullParagraph));
+#endif
+        _paragraphsList.erase(paragraph);
+    }
 
-    Utils::Split(fullParagraph, paragraph.lines, '\n');
-    _paragraphsList.push_back(std::move(paragraph));
+    // don't keep results in a half filled envelope, the Master is waiting for them
+    writer.Flush();
+    return !processedParagraphs.empty();
 }
 
-void Worker::ProcessLastParagraph()
+void Worker::WaitForProcessedParagraphs(bool receiving)
 {
-    auto& paragraph = _paragraphsList.back();
-    auto numOfLines = paragraph.lines.size();
-
-    for (size_t start = 0; start < numOfLines; start += LINES_PER_WORKER_THREAD) {
-        size_t end = std::min(start + LINES_PER_WORKER_THREAD, numOfLines);
+    std::unique_lock<std::mutex> lock(_processedMutex);
+    auto predicate = [this]() { return !_processedParagraphs.empty(); };
 
-        _threadPool.AddJob([this, start, end, &paragraph]() {
-            for (auto i = start; i != end; ++i) {
-                ProcessLine(paragraph.lines[i]);
-            }
-        });
+    if (receiving) {
+        // new messages from the Master don't wake this thread up, so it has to come back and poll for them
+        _processedCondVar.wait_for(lock, std::chrono::microseconds(WORKER_POLL_INTERVAL_US), predicate);
+    }
+    else {
+        _processedCondVar.wait(lock, predicate);
     }
 }
 
-
-void WorkerHorror::ProcessLine(std::string& line)
+void Worker::ReceiveParagraph(int globalParagraphIdx, const char* text, int length)
 {
-    std::string newLine;
+    _paragraphsList.emplace_back();
+
+    Worker::Paragraph& paragraph = _paragraphsList.back();
+    paragraph.globalIdx = globalParagraphIdx;
 
-    for (auto ch : line) {
-        newLine += ch;
-        if (Utils::IsConsonant(ch)) {
-            newLine += static_cast<char>(tolower(ch));
+    // the paragraph always ends with an extra empty line (the output gets one more '\n' than the input),
+    // with the '\n' appended below every line is terminated, the last one included
+    paragraph.text.reserve(length + 1);
+    paragraph.text.assign(text, length);
+    paragraph.text += '\n';
+
+    const char* begin = paragraph.text.c_str();
+    const char* end = begin + paragraph.text.length();
+    size_t numOfLines = std::count(begin, end, '\n');
+    size_t lineIdx = 0;
+
+    paragraph.chunkOffsets.reserve((numOfLines + LINES_PER_WORKER_THREAD - 1) / LINES_PER_WORKER_THREAD + 1);
+    paragraph.chunkOffsets.push_back(0);
+    for (const char* newLine = begin; (newLine = static_cast<const char*>(memchr(newLine, '\n', end - newLine))); ++newLine) {
+        if (++lineIdx % LINES_PER_WORKER_THREAD == 0 || lineIdx == numOfLines) {
+            paragraph.chunkOffsets.push_back(newLine - begin + 1);
         }
     }
-
-    line = std::move(newLine);
 }
 
-void WorkerComedy::ProcessLine(std::string& line)
+void Worker::ProcessLastParagraph()
 {
-    std::string newLine;
-    int idx = 1;
+    ProcessParagraph(std::prev(_paragraphsList.end()));
+}
 
-    for (auto ch : line) {
-        if (ch == ' ') {
-            idx = 0;
-        }
-        else if (idx % 2 == 0 && isalpha(ch)) {
-            ch = static_cast<char>(toupper(ch));
-        }
+void Worker::OnParagraphProcessed(std::list<Worker::Paragraph>::iterator paragraph)
+{
+    std::unique_lock<std::mutex> lock(_processedMutex);
 
-        newLine += ch;
-        idx++;
-    }
+    _processedParagraphs.push_back(paragraph);
+    _processedCondVar.notify_one();
+}
 
-    line = std::move(newLine);
+#ifdef PROTOCOL_SIZE_FRAMES
+// The paragraphs were sent back in the order they were processed, the second pass goes in ID order
+void Worker::SortOutputParagraphs()
+{
+    std::sort(_outputParagraphs.begin(), _outputParagraphs.end(),
+        [](const std::pair<int, std::string>& a, const std::pair<int, std::string>& b) { return a.first < b.first; });
 }
+#endif
 
-void WorkerFantasy::ProcessLine(std::string& line)
+#ifdef OUTPUT_MPI_IO
+// Writes every processed paragraph (header included) at the offset computed by the Master
+void Worker::WriteOutputParagraphs()
 {
-    std::string newLine;
-    bool upperNext = true;
+    std::vector<int64_t> offsets;
+    std::vector<OutputBlock> blocks;
+    std::string paragraphHeader;
+    MPI_Status status;
+    int rank, numOffsets;
 
-    for (auto ch : line) {
-        if (ch == ' ') {
-            upperNext = true;
-        }
-        else if (upperNext) {
-            upperNext = false;
-            if (isalpha(ch)) {
-                ch = static_cast<char>(toupper(ch));
-            }
-        }
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    paragraphHeader = GetNodeNameFromRank(rank) + '\n';
+
+    MPI_Probe(RANK_MASTER, PROTOCOL_TAG_OUTPUT_OFFSETS, MPI_COMM_WORLD, &status);
+    MPI_Get_count(&status, MPI_INT64_T, &numOffsets);
+
+    offsets.resize(numOffsets);
+    MPI_Recv(offsets.data(), numOffsets, MPI_INT64_T, RANK_MASTER, PROTOCOL_TAG_OUTPUT_OFFSETS, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+    if (offsets.size() != _outputParagraphs.size()) {
+        LOG_FATAL("Received {} output offsets for {} paragraphs", offsets.size(), _outputParagraphs.size());
+    }
+
+    SortOutputParagraphs();
 
-        newLine += ch;
+    for (size_t i = 0; i != offsets.size(); ++i) {
+        const std::string& text = _outputParagraphs[i].second;
+
+        blocks.push_back({ offsets[i], paragraphHeader.c_str(), static_cast<int>(paragraphHeader.length()) });
+        blocks.push_back({ static_cast<MPI_Offset>(offsets[i] + paragraphHeader.length()), text.c_str(), static_cast<int>(text.length()) });
     }
 
-    line = std::move(newLine);
+    _outputFile.WriteBlocks(blocks);
+    _outputFile.Close();
+
+    LOG_DEBUG("Output paragraphs written ({} paragraphs)", _outputParagraphs.size());
 }
+#endif
 
-// WARNING: This function assumes that words are separed by a **SINGLE** space
-void WorkerSF::ProcessLine(std::string& line)
+#ifdef OUTPUT_MMAP
+// Sends the processed texts to the Master, which receives them right into the mapped output file
+void Worker::SendOutputParagraphs()
 {
-    std::vector<std::string> tokens;
+    SortOutputParagraphs();
 
-    Utils::Split(line, tokens);
-    for (size_t i = 6; i < tokens.size(); i += 7) {
-        Utils::Reverse(tokens[i]);
-    }
+    for (auto& paragraph : _outputParagraphs) {
+        const char* payload = paragraph.second.c_str();
+        int64_t length = paragraph.second.length();
+
+        // same split as on the Master side: no message is larger than PROTOCOL_MAX_MESSAGE_SIZE
+        while (length > 0) {
+            int fragmentLength = std::min<int64_t>(length, PROTOCOL_MAX_MESSAGE_SIZE);
 
-    line.clear();
-    for (auto& token : tokens) {
-        line += token + ' ';
+            MPI_Send(payload, fragmentLength, MPI_BYTE, RANK_MASTER, PROTOCOL_TAG_OUTPUT_PAYLOAD, MPI_COMM_WORLD);
+
+            payload += fragmentLength;
+            length -= fragmentLength;
+        }
     }
-    line.pop_back();
+
+    LOG_DEBUG("Output paragraphs sent ({} paragraphs)", _outputParagraphs.size());
 }
+#endif
@@ -0,0 +1,224 @@
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "KernelTable.h"
+#include "Kernels.h"
+#include "ReferenceKernels.h"
+#include "Utils.h"
+
+// Throughput and cost per byte of the original per-line code ("before") and of every ISA variant of the kernels this
+// CPU supports ("after"), for every genre; and of the character classification alone: ctype calls (what the per-line
+// code did) against the Utils::CharTable lookup the kernels use
+// Built and run by `make bench`, on generated text; the executable also takes the path of an input file
+
+
+namespace
+{
+    const size_t GENERATED_TEXT_LENGTH = 16 * 1024 * 1024;
+    const double MIN_MEASURED_SECONDS = 0.5;
+
+    struct Genre
+    {
+        const char* name;
+        void (*processLine)(std::string& line);
+        size_t (*Kernels::KernelTable::*outputLength)(const char* input, size_t length);   // null if it keeps the length
+        void (*Kernels::KernelTable::*transform)(const char* input, size_t length, char* output);
+    };
+
+    const Genre GENRES[] = {
+        { "horror", Reference::Horror, &Kernels::KernelTable::horrorOutputLength, &Kernels::KernelTable::horrorTransform },
+        { "comedy", Reference::Comedy, nullptr, &Kernels::KernelTable::comedyTransform },
+        { "fantasy", Reference::Fantasy, nullptr, &Kernels::KernelTable::fantasyTransform },
+        { "sf", Reference::SF, nullptr, &Kernels::KernelTable::sfTransform }
+    };
+
+
+    // Lines of 5..20 words of 1..12 letters (a few capitalized or followed by punctuation), separated by single spaces
+    std::string GenerateText()
+    {
+        static const char PUNCTUATION[] = ".,;!?";
+        std::mt19937 rng(42);
+        std::string text;
+
+        while (text.length() < GENERATED_TEXT_LENGTH) {
+            int numOfWords = 5 + rng() % 16;
+
+            for (int word = 0; word != numOfWords; ++word) {
+                int wordLength = 1 + rng() % 12;
+
+                for (int i = 0; i != wordLength; ++i) {
+                    char ch = static_cast<char>('a' + rng() % 26);
+                    text += (i == 0 && rng() % 8 == 0) ? static_cast<char>(ch - 'a' + 'A') : ch;
+                }
+                if (rng() % 10 == 0) {
+                    text += PUNCTUATION[rng() % (sizeof(PUNCTUATION) - 1)];
+                }
+                text += (word + 1 == numOfWords) ? '\n' : ' ';
+            }
+        }
+
+        return text;
+    }
+
+    bool ReadFile(const char* fileName, std::string& text)
+    {
+        FILE* file = fopen(fileName, "rb");
+        char buffer[64 * 1024];
+        size_t numRead;
+
+        if (file == nullptr) {
+            return false;
+        }
+
+        while ((numRead = fread(buffer, 1, sizeof(buffer), file)) != 0) {
+            text.append(buffer, numRead);
+        }
+        fclose(file);
+
+        if (!text.empty() && text.back() != '\n') {
+            text += '\n';
+        }
+        return !text.empty();
+    }
+
+    std::vector<std::string> SplitLines(const std::string& text)
+    {
+        std::vector<std::string> lines;
+        size_t lineStart = 0;
+
+        while (lineStart < text.length()) {
+            size_t lineEnd = text.find('\n', lineStart);
+            lines.push_back(text.substr(lineStart, lineEnd - lineStart));
+            lineStart = lineEnd + 1;
+        }
+
+        return lines;
+    }
+
+    // Seconds per pass over the text; the lines are copied before every pass (not measured), like the workers used to
+    // receive them already split
+    double MeasureReference(const Genre& genre, const std::vector<std::string>& lines)
+    {
+        std::vector<std::string> work;
+        double seconds = 0;
+        int numOfPasses = 0;
+
+        while (seconds < MIN_MEASURED_SECONDS) {
+            work = lines;
+
+            auto start = std::chrono::steady_clock::now();
+            for (auto& line : work) {
+                genre.processLine(line);
+            }
+            seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            numOfPasses++;
+        }
+
+        return seconds / numOfPasses;
+    }
+
+    // Classifies every byte of the text (letter, consonant, upper and lower case), the way the per-line code did it or
+    // through the table; returns the seconds per pass
+    double MeasureCharClasses(const std::string& text, bool useTable)
+    {
+        auto start = std::chrono::steady_clock::now();
+        double seconds = 0;
+        int numOfPasses = 0;
+        volatile unsigned int sink = 0;
+
+        while (seconds < MIN_MEASURED_SECONDS) {
+            unsigned int sum = 0;
+
+            if (useTable) {
+                for (char ch : text) {
+                    const Utils::CharTraits& traits = Utils::CharTable::entries[static_cast<unsigned char>(ch)];
+                    sum += traits.isLetter + traits.isConsonant + traits.upper + traits.lower;
+                }
+            }
+            else {
+                for (char ch : text) {
+                    sum += (isalpha(ch) != 0) + Reference::IsConsonant(ch) + toupper(ch) + tolower(ch);
+                }
+            }
+            sink = sink + sum;
+
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            numOfPasses++;
+        }
+
+        return seconds / numOfPasses;
+    }
+
+    void PrintResult(const char* what, const char* code, size_t numOfBytes, double seconds, double referenceSeconds)
+    {
+        printf("%-8s %-10s %10.1f %8.2f %8.1fx\n", what, code, numOfBytes / seconds / 1e6, seconds * 1e9 / numOfBytes,
+               referenceSeconds / seconds);
+    }
+
+    // Seconds per pass over the text, output length included
+    double MeasureKernel(const Genre& genre, const Kernels::KernelTable& table, const std::string& text, std::string& output)
+    {
+        auto start = std::chrono::steady_clock::now();
+        double seconds = 0;
+        int numOfPasses = 0;
+
+        while (seconds < MIN_MEASURED_SECONDS) {
+            size_t outputLength = genre.outputLength ? (table.*genre.outputLength)(text.data(), text.length()) : text.length();
+
+            output.resize(outputLength);
+            (table.*genre.transform)(text.data(), text.length(), &output[0]);
+
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            numOfPasses++;
+        }
+
+        return seconds / numOfPasses;
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    const Kernels::KernelTable* allTables[] = { &Kernels::Baseline::TABLE, &Kernels::AVX2::TABLE, &Kernels::AVX512::TABLE };
+    std::string text;
+    std::string output;
+
+    if (argc > 1) {
+        if (!ReadFile(argv[1], text)) {
+            printf("Couldn't read \"%s\"\n", argv[1]);
+            return 1;
+        }
+    }
+    else {
+        text = GenerateText();
+    }
+
+    std::vector<std::string> lines = SplitLines(text);
+
+    printf("%.1f MB, %zu lines; the workers would use the %s kernels\n\n", text.length() / 1e6, lines.size(),
+           Kernels::GetTargetName());
+    printf("%-8s %-10s %10s %8s %9s\n", "genre", "code", "MB/s", "ns/byte", "speedup");
+
+    double ctypeSeconds = MeasureCharClasses(text, false);
+    PrintResult("classes", "ctype", text.length(), ctypeSeconds, ctypeSeconds);
+    PrintResult("classes", "table", text.length(), MeasureCharClasses(text, true), ctypeSeconds);
+
+    for (const Genre& genre : GENRES) {
+        double referenceSeconds = MeasureReference(genre, lines);
+
+        PrintResult(genre.name, "per-line", text.length(), referenceSeconds, referenceSeconds);
+
+        for (const Kernels::KernelTable* table : allTables) {
+            if (!Kernels::IsSupported(*table)) {
+                continue;
+            }
+
+            PrintResult(genre.name, table->name, text.length(), MeasureKernel(genre, *table, text, output), referenceSeconds);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,226 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "KernelTable.h"
+#include "Kernels.h"
+#include "ReferenceKernels.h"
+
+// Equivalence tests of every ISA variant of the kernels (the ones this CPU supports) against the original per-line code
+// Built and run by `make test`; the exit code is the number of failed tests
+
+
+namespace
+{
+    typedef std::vector<const Kernels::KernelTable*> KernelTables;
+    typedef bool (*TestFunc)(const KernelTables& tables);
+    typedef size_t (*Kernels::KernelTable::*OutputLengthEntry)(const char* input, size_t length);
+    typedef void (*Kernels::KernelTable::*TransformEntry)(const char* input, size_t length, char* output);
+
+    // Two AVX-512 blocks and a tail: every lane of every block size, and the scalar tail, gets every byte value
+    const size_t EXHAUSTIVE_MAX_LINE_LENGTH = 2 * 64 + 1;
+    const int RANDOM_TEST_ITERATIONS = 20000;
+    const unsigned int RANDOM_SEED = 42;
+    // Long enough for a word to span several 64 byte blocks, so the per-word state is carried across blocks
+    const size_t LONG_WORD_LENGTH = 300;
+
+
+    // Lines of words separated by one or more spaces; the words are mostly letters, with some punctuation and some
+    // arbitrary bytes (anything but '\n'). Some runs of spaces are longer than a block, some are around a line break.
+    // With `singleSpaces`, every separator is a single space or '\n' (and the words hold no spaces)
+    std::string RandomText(std::mt19937& rng, size_t maxWordLength, bool singleSpaces)
+    {
+        static const char LETTERS[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+        static const char OTHERS[] = "0123456789.,;:!?'\"-()";
+
+        size_t length = rng() % 2000;
+        std::string text;
+
+        while (text.length() < length) {
+            size_t wordLength = 1 + rng() % maxWordLength;
+
+            for (size_t i = 0; i != wordLength; ++i) {
+                unsigned int kind = rng() % 100;
+                char ch;
+
+                if (kind < 85) {
+                    ch = LETTERS[rng() % (sizeof(LETTERS) - 1)];
+                }
+                else if (kind < 95) {
+                    ch = OTHERS[rng() % (sizeof(OTHERS) - 1)];
+                }
+                else {
+                    do {
+                        ch = static_cast<char>(rng() % 256);
+                    } while (ch == '\n' || (singleSpaces && ch == ' '));
+                }
+                text += ch;
+            }
+
+            unsigned int separator = rng() % 100;
+            if (separator < 80 || (separator >= 90 && singleSpaces)) {
+                text += ' ';
+            }
+            else if (separator < 90) {
+                text += '\n';
+            }
+            else {
+                text.append(2 + rng() % (separator < 97 ? 3 : 130), ' ');
+                if (separator % 2) {
+                    text += '\n';
+                    text.append(rng() % 3, ' ');
+                }
+            }
+        }
+
+        if (text.empty() || text.back() != '\n') {
+            text += '\n';
+        }
+        return text;
+    }
+
+    // Runs a kernel with input and output buffers of exactly the right size, so that a sanitizer or valgrind catches
+    // any access past them. Kernels without `outputLength` keep the length and also run in place
+    bool CheckKernel(const Kernels::KernelTable& table, OutputLengthEntry outputLength, TransformEntry transform,
+                     const std::string& text, const std::string& expected)
+    {
+        char* input = static_cast<char*>(malloc(text.length()));
+        memcpy(input, text.data(), text.length());
+
+        size_t length = outputLength ? (table.*outputLength)(input, text.length()) : text.length();
+        bool ok = (length == expected.length());
+
+        if (ok) {
+            char* output = static_cast<char*>(malloc(length));
+            (table.*transform)(input, text.length(), output);
+            ok = (memcmp(output, expected.data(), length) == 0);
+            free(output);
+        }
+
+        if (ok && !outputLength) {
+            (table.*transform)(input, text.length(), input);
+            ok = (memcmp(input, expected.data(), length) == 0);
+        }
+
+        free(input);
+        return ok;
+    }
+
+    // Every kernel variant against `processLine` on RANDOM_TEST_ITERATIONS random texts; half of them have words of
+    // up to LONG_WORD_LENGTH bytes
+    bool CompareOnRandomText(const KernelTables& tables, void (*processLine)(std::string&), OutputLengthEntry outputLength,
+                             TransformEntry transform, bool singleSpaces = false)
+    {
+        std::mt19937 rng(RANDOM_SEED);
+
+        for (int iteration = 0; iteration != RANDOM_TEST_ITERATIONS; ++iteration) {
+            std::string text = RandomText(rng, iteration % 2 ? LONG_WORD_LENGTH : 20, singleSpaces);
+            std::string expected = Reference::TransformLines(processLine, text);
+
+            for (const Kernels::KernelTable* table : tables) {
+                if (!CheckKernel(*table, outputLength, transform, text, expected)) {
+                    printf("  %s: iteration %d (%zu bytes)\n", table->name, iteration, text.length());
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    // Every byte value at every position of every line length up to EXHAUSTIVE_MAX_LINE_LENGTH, in a line of
+    // consonants (the output of every lane moves) and in a line of vowels (nothing moves)
+    bool TestHorrorExhaustive(const KernelTables& tables)
+    {
+        const char fillers[] = { 'x', 'a' };
+
+        for (char filler : fillers) {
+            for (size_t lineLength = 1; lineLength <= EXHAUSTIVE_MAX_LINE_LENGTH; ++lineLength) {
+                for (size_t pos = 0; pos != lineLength; ++pos) {
+                    for (int byte = 0; byte != 256; ++byte) {
+                        if (byte == '\n') {
+                            continue;
+                        }
+
+                        std::string text(lineLength, filler);
+                        text[pos] = static_cast<char>(byte);
+                        text += '\n';
+
+                        std::string expected = Reference::TransformLines(Reference::Horror, text);
+                        for (const Kernels::KernelTable* table : tables) {
+                            if (!CheckKernel(*table, &Kernels::KernelTable::horrorOutputLength,
+                                             &Kernels::KernelTable::horrorTransform, text, expected)) {
+                                printf("  %s: byte %d at position %zu of a %zu byte line ('%c' filler)\n",
+                                       table->name, byte, pos, lineLength, filler);
+                                return false;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        return true;
+    }
+
+    bool TestHorrorRandom(const KernelTables& tables)
+    {
+        return CompareOnRandomText(tables, Reference::Horror, &Kernels::KernelTable::horrorOutputLength,
+                                   &Kernels::KernelTable::horrorTransform);
+    }
+
+    bool TestComedyRandom(const KernelTables& tables)
+    {
+        return CompareOnRandomText(tables, Reference::Comedy, nullptr, &Kernels::KernelTable::comedyTransform);
+    }
+
+    bool TestFantasyRandom(const KernelTables& tables)
+    {
+        return CompareOnRandomText(tables, Reference::Fantasy, nullptr, &Kernels::KernelTable::fantasyTransform);
+    }
+
+    // The new word rule on any text, and the original code on single-space text (where the two rules agree)
+    bool TestSFRandom(const KernelTables& tables)
+    {
+        return CompareOnRandomText(tables, Reference::SFWords, nullptr, &Kernels::KernelTable::sfTransform) &&
+               CompareOnRandomText(tables, Reference::SF, nullptr, &Kernels::KernelTable::sfTransform, true);
+    }
+
+    bool RunTest(const char* name, TestFunc test, const KernelTables& tables)
+    {
+        bool passed = test(tables);
+
+        printf("[%s] %s\n", passed ? "  OK  " : "FAILED", name);
+        return passed;
+    }
+}
+
+
+int main()
+{
+    const Kernels::KernelTable* allTables[] = { &Kernels::Baseline::TABLE, &Kernels::AVX2::TABLE, &Kernels::AVX512::TABLE };
+    KernelTables tables;
+    int numFailed = 0;
+
+    for (const Kernels::KernelTable* table : allTables) {
+        if (Kernels::IsSupported(*table)) {
+            tables.push_back(table);
+        }
+        else {
+            printf("Skipping the %s kernels, not supported by this CPU\n", table->name);
+        }
+    }
+
+    printf("The workers would use the %s kernels\n", Kernels::GetTargetName());
+
+    numFailed += !RunTest("Horror, every byte at every position", TestHorrorExhaustive, tables);
+    numFailed += !RunTest("Horror, random text", TestHorrorRandom, tables);
+    numFailed += !RunTest("Comedy, random text, in place too", TestComedyRandom, tables);
+    numFailed += !RunTest("Fantasy, random text, in place too", TestFantasyRandom, tables);
+    numFailed += !RunTest("SF, random text, in place too", TestSFRandom, tables);
+
+    return numFailed;
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cctype>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+
+// The per-line transforms the workers used before the kernels (WorkerHorror::ProcessLine & co.), kept as they were:
+// the kernels must produce exactly the same bytes (SF only on text whose words are separated by single spaces, see
+// SFWords)
+namespace Reference
+{
+    inline bool IsConsonant(char ch)
+    {
+        int lowCh = tolower(ch);
+        return (isalpha(ch) && lowCh != 'a' && lowCh != 'e' && lowCh != 'i' && lowCh != 'o' && lowCh != 'u');
+    }
+
+    inline void Horror(std::string& line)
+    {
+        std::string newLine;
+
+        for (auto ch : line) {
+            newLine += ch;
+            if (IsConsonant(ch)) {
+                newLine += static_cast<char>(tolower(ch));
+            }
+        }
+
+        line = std::move(newLine);
+    }
+
+    inline void Comedy(std::string& line)
+    {
+        std::string newLine;
+        int idx = 1;
+
+        for (auto ch : line) {
+            if (ch == ' ') {
+                idx = 0;
+            }
+            else if (idx % 2 == 0 && isalpha(ch)) {
+                ch = static_cast<char>(toupper(ch));
+            }
+
+            newLine += ch;
+            idx++;
+        }
+
+        line = std::move(newLine);
+    }
+
+    inline void Fantasy(std::string& line)
+    {
+        std::string newLine;
+        bool upperNext = true;
+
+        for (auto ch : line) {
+            if (ch == ' ') {
+                upperNext = true;
+            }
+            else if (upperNext) {
+                upperNext = false;
+                if (isalpha(ch)) {
+                    ch = static_cast<char>(toupper(ch));
+                }
+            }
+
+            newLine += ch;
+        }
+
+        line = std::move(newLine);
+    }
+
+    // WARNING: This function assumes that words are separed by a **SINGLE** space
+    inline void SF(std::string& line)
+    {
+        std::vector<std::string> tokens;
+        size_t current, previous = 0;
+
+        current = line.find(' ');
+        while (current != std::string::npos) {
+            tokens.push_back(line.substr(previous, current - previous));
+            previous = current + 1;
+            current = line.find(' ', previous);
+        }
+        tokens.push_back(line.substr(previous, current - previous));
+
+        for (size_t i = 6; i < tokens.size(); i += 7) {
+            std::reverse(tokens[i].begin(), tokens[i].end());
+        }
+
+        line.clear();
+        for (auto& token : tokens) {
+            line += token + ' ';
+        }
+        line.pop_back();
+    }
+
+    // The SF rule of the kernels: the words are the maximal runs of non-space bytes, so several spaces in a row (or
+    // leading / trailing ones) don't count as empty words. Same result as SF when the words are separated by single spaces
+    inline void SFWords(std::string& line)
+    {
+        size_t wordStart = line.find_first_not_of(' ');
+        int wordIdx = 0;
+
+        while (wordStart != std::string::npos) {
+            size_t wordEnd = line.find(' ', wordStart);
+            if (wordEnd == std::string::npos) {
+                wordEnd = line.length();
+            }
+
+            if (++wordIdx % 7 == 0) {
+                std::reverse(line.begin() + wordStart, line.begin() + wordEnd);
+            }
+            wordStart = line.find_first_not_of(' ', wordEnd);
+        }
+    }
+
+    // Applies a per-line transform to every line of `text` (every line terminated by '\n', like the kernels' input)
+    inline std::string TransformLines(void (*processLine)(std::string&), const std::string& text)
+    {
+        std::string result;
+        size_t lineStart = 0;
+
+        while (lineStart < text.length()) {
+            size_t lineEnd = text.find('\n', lineStart);
+            std::string line = text.substr(lineStart, lineEnd - lineStart);
+
+            processLine(line);
+            result += line;
+            result += '\n';
+            lineStart = lineEnd + 1;
+        }
+
+        return result;
+    }
+}